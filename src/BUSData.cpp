@@ -35,6 +35,19 @@ uint64_t stringToBinary(const char* s, const size_t len, uint32_t &flag) {
   return r;
 }
 
+uint64_t UMIPacker::pack(const char *s, size_t len) {
+  bool acgt = (len <= 25);
+  for (size_t i = 0; i < len && acgt; i++) {
+    acgt = (s[i] == 'A' || s[i] == 'C' || s[i] == 'G' || s[i] == 'T');
+  }
+  if (acgt) {
+    uint32_t f = 0;
+    return stringToBinary(s, len, f) | ((uint64_t) len << 57);
+  }
+  auto it = others.insert({std::string(s, len), (1ULL << 63) | others.size()}).first;
+  return it->second;
+}
+
 std::string binaryToString(uint64_t x, size_t len) {
   std::string s(len, 'N');
   size_t sh = len-1;
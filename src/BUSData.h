@@ -2,6 +2,7 @@
 #define KALLISTO_BUSDATA_H
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <stdint.h>
 
@@ -38,4 +39,17 @@ struct BUSData {
 uint64_t stringToBinary(const std::string &s, uint32_t &flag);
 uint64_t stringToBinary(const char* s, const size_t len, uint32_t &flag);
 std::string binaryToString(uint64_t x, size_t len);
+
+// Integer keys for UMIs, equal exactly when the UMIs are. UMIs of up to 25
+// bases of A, C, G and T are packed like stringToBinary does with their
+// length above. stringToBinary reads N as G and keeps at most 32 bases, so
+// any other UMI gets the next id from a table of the ones seen, with the
+// top bit set.
+class UMIPacker {
+public:
+  uint64_t pack(const char *s, size_t len);
+
+private:
+  std::unordered_map<std::string, uint64_t> others;
+};
 #endif // KALLISTO_BUSDATA_H
\ No newline at end of file
@@ -32,17 +32,16 @@ BootstrapThreadPool::BootstrapThreadPool(
   eff_lens_(eff_lens),
   opt_(p_opts),
   writer_(bswriter),
-  mean_fls_(mean_fls)
+  mean_fls_(mean_fls),
+  workers_(ThreadPool::shared(p_opts.threads))
 {
   for (size_t i = 0; i < n_threads_; ++i) {
-    threads_.push_back( std::thread(BootstrapWorker(*this, i)) );
+    workers_.run(BootstrapWorker(*this, i));
   }
 }
 
 BootstrapThreadPool::~BootstrapThreadPool() {
-  for (size_t i = 0; i < n_threads_; ++i) {
-    threads_[i].join();
-  }
+  workers_.wait();
 }
 
 void BootstrapWorker::operator() (){
@@ -8,6 +8,7 @@
 #include "MinCollector.h"
 #include "weights.h"
 #include "EMAlgorithm.h"
+#include "ThreadPool.h"
 #include "Multinomial.hpp"
 
 
@@ -87,7 +88,6 @@ class BootstrapThreadPool {
     std::vector<size_t> seeds_;
     size_t n_threads_;
 
-    std::vector<std::thread> threads_;
     std::mutex seeds_mutex_;
     std::mutex write_lock_;
 
@@ -101,6 +101,9 @@ class BootstrapThreadPool {
     const ProgramOptions& opt_;
     BootstrapWriter *writer_;
     const std::vector<double>& mean_fls_;
+
+    // the workers run on the shared pool, the destructor waits for them
+    TaskGroup workers_;
 };
 
 class BootstrapWorker {
@@ -5,6 +5,7 @@
 #include "KmerIndex.h"
 #include "MinCollector.h"
 #include "weights.h"
+#include "PerfStats.h"
 
 #include <algorithm>
 #include <numeric>
@@ -64,6 +65,7 @@ struct EMAlgorithm {
       std::cerr << "[   em] quantifying the abundances ..."; std::cerr.flush();
     }
 
+    PerfTimer timer;
     int i;
     for (i = 0; i < n_iter; ++i) {
       if (recomputeEffLen && (i == min_rounds || i == min_rounds + 500)) {
@@ -169,6 +171,11 @@ struct EMAlgorithm {
 
     }
 
+    PerfCounters& perf = PerfStats::local();
+    perf.em_runs += 1;
+    perf.em_iterations += i;
+    perf.em_seconds += timer.seconds();
+
     // ran for the maximum number of iterations
     if (n_iter == i) {
       alpha_before_zeroes_.resize( alpha_.size() );
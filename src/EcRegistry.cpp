@@ -0,0 +1,75 @@
+#include "EcRegistry.h"
+
+EcRegistry::EcRegistry(int offset) : first_id(offset) {
+  tables.emplace_back(new Table(1 << 12));
+  table.store(tables.back().get());
+}
+
+EcRegistry::~EcRegistry() {}
+
+uint64_t EcRegistry::hashEc(const std::vector<int>& u) {
+  uint64_t h = 0x9E3779B97F4A7C15ULL ^ u.size();
+  for (auto x : u) {
+    h ^= (uint32_t) x;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 31;
+  }
+  return h;
+}
+
+int EcRegistry::probe(const Table* t, const std::vector<int>& u, uint64_t h) {
+  size_t i = h & t->mask;
+  while (true) {
+    const Entry* e = t->slots[i].load(std::memory_order_acquire);
+    if (e == nullptr) {
+      return -1;
+    }
+    if (e->hash == h && e->u == u) {
+      return e->id;
+    }
+    i = (i + 1) & t->mask;
+  }
+}
+
+void EcRegistry::place(Table* t, Entry* e) {
+  size_t i = e->hash & t->mask;
+  while (t->slots[i].load(std::memory_order_relaxed) != nullptr) {
+    i = (i + 1) & t->mask;
+  }
+  t->slots[i].store(e, std::memory_order_release);
+}
+
+int EcRegistry::find(const std::vector<int>& u) const {
+  return probe(table.load(std::memory_order_acquire), u, hashEc(u));
+}
+
+int EcRegistry::findOrInsert(const std::vector<int>& u) {
+  uint64_t h = hashEc(u);
+  int id = probe(table.load(std::memory_order_acquire), u, h);
+  if (id != -1) {
+    return id;
+  }
+
+  std::lock_guard<std::mutex> lock(insert_lock);
+  // another thread may have added it or grown the table in the meantime
+  Table* t = table.load(std::memory_order_relaxed);
+  id = probe(t, u, h);
+  if (id != -1) {
+    return id;
+  }
+
+  Entry* e = new Entry{u, h, first_id + (int) entries.size()};
+  entries.emplace_back(e);
+  if (2 * entries.size() > t->slots.size()) {
+    // keep the load below one half, readers of the old table finish there
+    Table* bigger = new Table(2 * t->slots.size());
+    for (const auto& x : entries) {
+      place(bigger, x.get());
+    }
+    tables.emplace_back(bigger);
+    table.store(bigger, std::memory_order_release);
+  } else {
+    place(t, e);
+  }
+  return e->id;
+}
@@ -0,0 +1,61 @@
+#ifndef KALLISTO_ECREGISTRY_H
+#define KALLISTO_ECREGISTRY_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Equivalence classes found while processing reads, shared by the worker
+// threads. Each new class gets the next id after the ones already in the
+// index as soon as it is seen, so workers can count it like any other EC.
+//
+// Lookups don't take a lock. Entries are never modified once they are
+// published in the open addressing table, and when the table grows the old
+// one is kept around so threads still probing it stay safe. Inserts are
+// serialized by a mutex.
+class EcRegistry {
+public:
+  EcRegistry(int offset);
+  ~EcRegistry();
+
+  // returns the id of u, adding it if it hasn't been seen before
+  int findOrInsert(const std::vector<int>& u);
+
+  // returns the id of u or -1
+  int find(const std::vector<int>& u) const;
+
+  int offset() const { return first_id; }
+  size_t size() const { return entries.size(); }
+  // the i-th class added, its id is offset() + i. not safe while inserting
+  const std::vector<int>& get(size_t i) const { return entries[i]->u; }
+
+private:
+  struct Entry {
+    std::vector<int> u;
+    uint64_t hash;
+    int id;
+  };
+  struct Table {
+    std::vector<std::atomic<Entry*>> slots;
+    size_t mask;
+    Table(size_t n) : slots(n), mask(n - 1) {
+      for (auto& s : slots) {
+        s.store(nullptr, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  static uint64_t hashEc(const std::vector<int>& u);
+  static int probe(const Table* t, const std::vector<int>& u, uint64_t h);
+  static void place(Table* t, Entry* e);
+
+  const int first_id;
+  std::atomic<Table*> table;
+  std::vector<std::unique_ptr<Table>> tables; // current one last
+  std::vector<std::unique_ptr<Entry>> entries;
+  std::mutex insert_lock;
+};
+
+#endif // KALLISTO_ECREGISTRY_H
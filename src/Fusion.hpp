@@ -66,7 +66,7 @@ std::vector<int> simpleIntersect(const KmerIndex& index, const std::vector<EcDat
     if (v[i].first.getData()->id != v[i-1].first.getData()->id) {
       ec = v[i].first.getData()->id;
       if (ec != lastEC) {
-        u = index.intersect(ec, u);
+        index.intersectInPlace(ec, u);
         lastEC = ec;
         if (u.empty()) {
           return u;
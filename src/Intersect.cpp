@@ -0,0 +1,150 @@
+#include <algorithm>
+
+#include "Intersect.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define KALLISTO_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// lists this many times longer than the other one are galloped through
+static const size_t gallopRatio = 32;
+
+size_t intersectSorted(const int *a, size_t na, const int *b, size_t nb, int *out) {
+  static size_t (*const blocks)(const int*, size_t, const int*, size_t, int*) =
+    hasAVX2() ? intersectAVX2 : intersectSSE2;
+
+  if (na > nb) {
+    std::swap(a, b);
+    std::swap(na, nb);
+  }
+  if (na == 0) {
+    return 0;
+  }
+  if (na * gallopRatio < nb) {
+    return intersectGalloping(a, na, b, nb, out);
+  }
+  return blocks(a, na, b, nb, out);
+}
+
+// No kernel writes a match past the position it was read from in either
+// input, and the ids it writes over can't match anything later, so out
+// may be a or b.
+
+size_t intersectScalar(const int *a, size_t na, const int *b, size_t nb, int *out) {
+  size_t i = 0, j = 0, n = 0;
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      ++i;
+    } else if (b[j] < a[i]) {
+      ++j;
+    } else {
+      out[n++] = a[i];
+      ++i;
+      ++j;
+    }
+  }
+  return n;
+}
+
+size_t intersectGalloping(const int *a, size_t na, const int *b, size_t nb, int *out) {
+  if (na > nb) {
+    std::swap(a, b);
+    std::swap(na, nb);
+  }
+  size_t lo = 0, n = 0;
+  for (size_t i = 0; i < na && lo < nb; i++) {
+    int x = a[i];
+    // double the step until we pass x, then binary search the last step
+    size_t hi = lo, step = 1;
+    while (hi < nb && b[hi] < x) {
+      lo = hi + 1;
+      hi += step;
+      step <<= 1;
+    }
+    const int *p = std::lower_bound(b + lo, b + std::min(hi + 1, nb), x);
+    lo = p - b;
+    if (lo < nb && *p == x) {
+      out[n++] = x;
+      ++lo;
+    }
+  }
+  return n;
+}
+
+#ifdef KALLISTO_X86_SIMD
+
+// compares blocks of 4 ids against each other in all rotations
+size_t intersectSSE2(const int *a, size_t na, const int *b, size_t nb, int *out) {
+  size_t i = 0, j = 0, n = 0;
+  while (i + 4 <= na && j + 4 <= nb) {
+    __m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*) (b + j));
+    __m128i m = _mm_cmpeq_epi32(va, vb);
+    m = _mm_or_si128(m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0,3,2,1))));
+    m = _mm_or_si128(m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1,0,3,2))));
+    m = _mm_or_si128(m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2,1,0,3))));
+    int amax = a[i + 3], bmax = b[j + 3];
+    unsigned int mask = _mm_movemask_ps(_mm_castsi128_ps(m));
+    while (mask != 0) {
+      out[n++] = a[i + __builtin_ctz(mask)];
+      mask &= mask - 1;
+    }
+    if (amax <= bmax) {
+      i += 4;
+    }
+    if (bmax <= amax) {
+      j += 4;
+    }
+  }
+  return n + intersectScalar(a + i, na - i, b + j, nb - j, out + n);
+}
+
+// the same with blocks of 8
+__attribute__((target("avx2")))
+size_t intersectAVX2(const int *a, size_t na, const int *b, size_t nb, int *out) {
+  const __m256i rot = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+  size_t i = 0, j = 0, n = 0;
+  while (i + 8 <= na && j + 8 <= nb) {
+    __m256i va = _mm256_loadu_si256((const __m256i*) (a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*) (b + j));
+    __m256i m = _mm256_cmpeq_epi32(va, vb);
+    for (int r = 1; r < 8; r++) {
+      vb = _mm256_permutevar8x32_epi32(vb, rot);
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi32(va, vb));
+    }
+    int amax = a[i + 7], bmax = b[j + 7];
+    unsigned int mask = _mm256_movemask_ps(_mm256_castsi256_ps(m));
+    while (mask != 0) {
+      out[n++] = a[i + __builtin_ctz(mask)];
+      mask &= mask - 1;
+    }
+    if (amax <= bmax) {
+      i += 8;
+    }
+    if (bmax <= amax) {
+      j += 8;
+    }
+  }
+  return n + intersectSSE2(a + i, na - i, b + j, nb - j, out + n);
+}
+
+bool hasAVX2() {
+  return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+size_t intersectSSE2(const int *a, size_t na, const int *b, size_t nb, int *out) {
+  return intersectScalar(a, na, b, nb, out);
+}
+
+size_t intersectAVX2(const int *a, size_t na, const int *b, size_t nb, int *out) {
+  return intersectScalar(a, na, b, nb, out);
+}
+
+bool hasAVX2() {
+  return false;
+}
+
+#endif // KALLISTO_X86_SIMD
@@ -0,0 +1,25 @@
+#ifndef KALLISTO_INTERSECT_H
+#define KALLISTO_INTERSECT_H
+
+#include <stddef.h>
+
+// Intersection of sorted lists of distinct target ids.
+//
+// When one list is much shorter than the other the long one is searched
+// with galloping, otherwise both are compared block by block with AVX2 or
+// SSE2, whichever the cpu supports at run time, and merged in the tails.
+// The result is written to out in increasing order and its size returned.
+// out needs room for min(na, nb) ids and may be a or b, so a list can be
+// narrowed in place.
+size_t intersectSorted(const int *a, size_t na, const int *b, size_t nb, int *out);
+
+// the kernels, exposed so they can be tested against each other
+size_t intersectScalar(const int *a, size_t na, const int *b, size_t nb, int *out);
+size_t intersectGalloping(const int *a, size_t na, const int *b, size_t nb, int *out);
+size_t intersectSSE2(const int *a, size_t na, const int *b, size_t nb, int *out);
+size_t intersectAVX2(const int *a, size_t na, const int *b, size_t nb, int *out);
+
+// true if intersectAVX2 can run on this cpu
+bool hasAVX2();
+
+#endif // KALLISTO_INTERSECT_H
@@ -1,4 +1,6 @@
 #include "KmerIndex.h"
+#include "Intersect.h"
+#include "PerfStats.h"
 #include <algorithm>
 #include <random>
 #include <ctype.h>
@@ -96,21 +98,22 @@ void KmerIndex::BuildTranscripts(const ProgramOptions& opt) {
       if (l <= 0) {
         break;
       }
-      seqs.emplace_back(seq->seq.s);
+      bool acgt = upperACGT(seq->seq.s, seq->seq.l);
+      seqs.emplace_back(seq->seq.s, seq->seq.l);
       std::string& str = *seqs.rbegin();
-      auto n = str.size();
-      for (auto i = 0; i < n; i++) {
-        char c = str[i];
-        c = ::toupper(c);
-        if (c=='U') {
-          str[i] = 'T';
-          countUNuc++;
-        } else if (c !='A' && c != 'C' && c != 'G' && c != 'T') {
-          str[i] = Dna(gen()); // replace with pseudorandom string
-          countNonNucl++;
+      if (!acgt) {
+        auto n = str.size();
+        for (auto i = 0; i < n; i++) {
+          char c = str[i];
+          if (c=='U') {
+            str[i] = 'T';
+            countUNuc++;
+          } else if (c !='A' && c != 'C' && c != 'G' && c != 'T') {
+            str[i] = Dna(gen()); // replace with pseudorandom string
+            countNonNucl++;
+          }
         }
       }
-      std::transform(str.begin(), str.end(),str.begin(), ::toupper);
 
       if (str.size() >= 10 && str.substr(str.size()-10,10) == "AAAAAAAAAA") {
         // clip off polyA tail
@@ -811,7 +814,7 @@ int KmerIndex::mapPair(const char *s1, int l1, const char *s2, int l2, int ec) c
 
     if (!search.isEmpty) {
       found1 = true;
-      KmerEntry val = *search.getData();
+      const KmerEntry& val = *search.getData();
       c1 = val.id;
       if (forward == val.isFw()) {
         p1 = val.getPos() - kit1->second;
@@ -839,7 +842,7 @@ int KmerIndex::mapPair(const char *s1, int l1, const char *s2, int l2, int ec) c
 
     if (!search.isEmpty) {
       found2 = true;
-      KmerEntry val = *search.getData();
+      const KmerEntry& val = *search.getData();
       c2 = val.id;
       if (forward == val.isFw()) {
         p2 = val.getPos() - kit2->second;
@@ -873,10 +876,51 @@ int KmerIndex::mapPair(const char *s1, int l1, const char *s2, int l2, int ec) c
 
 }
 
+// use:  tl = mapPair(s1,val1,s2,val2)
+// pre:  val1 and val2 are the first mapping k-mers of s1 and s2, like
+//       findFirstMappingKmer returns them from the output of match
+// post: same as mapPair(s1,l1,s2,l2,ec) but without looking up the k-mers again
+int KmerIndex::mapPair(const char *s1, const EcDataPair& val1, const char *s2, const EcDataPair& val2) const {
+  auto offset = [&](const char *s, const EcDataPair& x, bool& d) {
+    Bifrost::Kmer km(s + x.second);
+    bool forward = (km == km.rep());
+    const KmerEntry* val = x.first.getData();
+    d = (forward == val->isFw());
+    return d ? (val->getPos() - x.second) : (val->getPos() + k + x.second);
+  };
+
+  if (val1.first.getData()->id != val2.first.getData()->id) {
+    return -1;
+  }
+
+  bool d1, d2;
+  int p1 = offset(s1, val1, d1);
+  int p2 = offset(s2, val2, d2);
+
+  if (d1 == d2) {
+    return -1;
+  }
+  return (p1 > p2) ? (p1 - p2) : (p2 - p1);
+}
+
 // use:  match(s,l,v)
 // pre:  v is initialized
 // post: v contains all equiv classes for the k-mers in s
-void KmerIndex::match(const char *s, int l, std::vector<EcDataPair>& v) const {
+void KmerIndex::match(const char *s, int l, std::vector<EcDataPair>& v, bool collapse) const {
+  // hits come in read order, with collapse a run of hits on one unitig
+  // keeps only its first and last entry
+  auto addHit = [&](const Bifrost::UnitigMap<KmerEntry, void, true>& um, int pos) {
+    size_t n = v.size();
+    int id = um.getData()->id;
+    if (collapse && n >= 2 && v[n-1].first.getData()->id == id && v[n-2].first.getData()->id == id) {
+      v[n-1] = {um, pos};
+    } else {
+      v.push_back({um, pos});
+    }
+  };
+
+  int64_t lookups = 0, hits = 0;
+
   Bifrost::KmerIterator kit(s), kit_end;
   bool backOff = false;
   int nextPos = 0; // nextPosition to check
@@ -884,12 +928,14 @@ void KmerIndex::match(const char *s, int l, std::vector<EcDataPair>& v) const {
     // need to check it
     auto search = dbGraph.find(kit->first.rep());
     int pos = kit->second;
+    ++lookups;
 
     if (!search.isEmpty) {
+      ++hits;
 
-      KmerEntry val = *search.getData();
+      const KmerEntry& val = *search.getData();
       
-      v.push_back({search, kit->second});
+      addHit(search, kit->second);
 
       // see if we can skip ahead
       // bring thisback later
@@ -913,6 +959,8 @@ void KmerIndex::match(const char *s, int l, std::vector<EcDataPair>& v) const {
         if (kit2 != kit_end) {
           Bifrost::Kmer rep2 = (*kit2).first.rep();
           auto search2 = dbGraph.find(rep2);
+          ++lookups;
+          hits += !search2.isEmpty;
           bool found2 = false;
           int  found2pos = pos+dist;
           if (search2.isEmpty) {
@@ -925,10 +973,10 @@ void KmerIndex::match(const char *s, int l, std::vector<EcDataPair>& v) const {
           if (found2) {
             // great, a match (or nothing) see if we can move the k-mer forward
             if (found2pos >= l-k) {
-              v.push_back({search, l-k}); // push back a fake position
+              addHit(search, l-k); // push back a fake position
               break; //
             } else {
-              v.push_back({search, found2pos});
+              addHit(search, found2pos);
               kit = kit2; // move iterator to this new position
             }
           } else {
@@ -944,7 +992,9 @@ void KmerIndex::match(const char *s, int l, std::vector<EcDataPair>& v) const {
               if (kit3 != kit_end) {
                 Bifrost::Kmer rep3 = kit3->first.rep();
                 auto search3 = dbGraph.find(rep3);
+                ++lookups;
                 if (!search3.isEmpty) {
+                  ++hits;
                   middleContig = search3.getData()->id;
                   if (middleContig == val.id) {
                     foundMiddle = true;
@@ -957,7 +1007,7 @@ void KmerIndex::match(const char *s, int l, std::vector<EcDataPair>& v) const {
 
 
                 if (foundMiddle) {
-                  v.push_back({search3, found3pos});
+                  addHit(search3, found3pos);
                   if (nextPos >= l-k) {
                     break;
                   } else {
@@ -994,9 +1044,11 @@ donejumping:
           // need to check it
           Bifrost:: Kmer rep = kit->first.rep();
           auto search = dbGraph.find(rep);
+          ++lookups;
           if (!search.isEmpty) {
             // if k-mer found
-            v.push_back({search, kit->second}); // add equivalence class, and position
+            ++hits;
+            addHit(search, kit->second); // add equivalence class, and position
           }
         }
 
@@ -1007,6 +1059,10 @@ donejumping:
       }
     }
   }
+
+  PerfCounters& perf = PerfStats::local();
+  perf.kmer_lookups += lookups;
+  perf.kmer_hits += hits;
 }
 
 std::pair<int,bool> KmerIndex::findPosition(int tr, Bifrost::Kmer km, int p) const {
@@ -1075,27 +1131,24 @@ std::vector<int> KmerIndex::intersect(int ec, const std::vector<int>& v) const {
     //if (search != ecmap.end()) {
     //auto& u = search->second;
     auto& u = ecmap[ec];
-    res.reserve(v.size());
-
-    auto a = u.begin();
-    auto b = v.begin();
-
-    while (a != u.end() && b != v.end()) {
-      if (*a < *b) {
-        ++a;
-      } else if (*b < *a) {
-        ++b;
-      } else {
-        // match
-        res.push_back(*a);
-        ++a;
-        ++b;
-      }
-    }
+    res.resize(std::min(u.size(), v.size()));
+    res.resize(intersectSorted(u.data(), u.size(), v.data(), v.size(), res.data()));
   }
   return res;
 }
 
+// use:  intersectInPlace(ec,v)
+// pre:  ec is in ecmap, v is sorted in increasing order
+// post: v contains the intersection of ecmap[ec] and the old v, its storage is reused
+void KmerIndex::intersectInPlace(int ec, std::vector<int>& v) const {
+  if (ec >= ecmap.size()) {
+    v.clear();
+    return;
+  }
+  auto& u = ecmap[ec];
+  v.resize(intersectSorted(u.data(), u.size(), v.data(), v.size(), v.data()));
+}
+
 
 void KmerIndex::loadTranscriptSequences() const {
   if (target_seqs_loaded) {
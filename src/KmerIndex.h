@@ -84,9 +84,11 @@ struct KmerIndex {
 
   ~KmerIndex() {}
 
-  void match(const char *s, int l, std::vector<EcDataPair>& v) const;
+  void match(const char *s, int l, std::vector<EcDataPair>& v, bool collapse = false) const;
   int mapPair(const char *s1, int l1, const char *s2, int l2, int ec) const;
+  int mapPair(const char *s1, const EcDataPair& val1, const char *s2, const EcDataPair& val2) const;
   std::vector<int> intersect(int ec, const std::vector<int>& v) const;
+  void intersectInPlace(int ec, std::vector<int>& v) const;
 
   void BuildTranscripts(const ProgramOptions& opt);
   void BuildDeBruijnGraph(const ProgramOptions& opt, const std::vector<std::string>& seqs);
@@ -1,26 +1,21 @@
 #include "MinCollector.h"
+#include "Intersect.h"
+#include "SeqScan.h"
 #include <algorithm>
 
 // utility functions
 
 std::vector<int> intersect(const std::vector<int>& x, const std::vector<int>& y) {
-  std::vector<int> v;
-  auto a = x.begin();
-  auto b = y.begin();
-  while (a != x.end() && b != y.end()) {
-    if (*a < *b) {
-      ++a;
-    } else if (*b < *a) {
-      ++b;
-    } else {
-      v.push_back(*a);
-      ++a;
-      ++b;
-    }
-  }
+  std::vector<int> v(std::min(x.size(), y.size()));
+  v.resize(intersectSorted(x.data(), x.size(), y.data(), y.size(), v.data()));
   return v;
 }
 
+// keeps the elements of x that are also in y, reusing the storage of x
+void intersectInPlace(std::vector<int>& x, const std::vector<int>& y) {
+  x.resize(intersectSorted(x.data(), x.size(), y.data(), y.size(), x.data()));
+}
+
 void MinCollector::init_mean_fl_trunc(double mean, double sd) {
   auto tmp_trunc_fl = trunc_gaussian_fld(0, MAX_FRAG_LEN, mean, sd);
   assert( tmp_trunc_fl.size() == mean_fl_trunc.size() );
@@ -35,9 +30,26 @@ void MinCollector::init_mean_fl_trunc(double mean, double sd) {
 
 int MinCollector::intersectKmers(std::vector<EcDataPair>& v1,
                           std::vector<EcDataPair>& v2, bool nonpaired, std::vector<int> &u) const {
-  std::vector<int> u1 = intersectECs(v1);
-  std::vector<int> u2 = intersectECs(v2);
+  std::vector<int> tmp;
+  return intersectKmers(v1, v2, nonpaired, u, tmp);
+}
 
+int MinCollector::intersectKmers(std::vector<EcDataPair>& v1,
+                          std::vector<EcDataPair>& v2, bool nonpaired, std::vector<int> &u,
+                          std::vector<int> &tmp) const {
+  // read 1 goes straight into u, read 2 into the scratch vector
+  intersectECs(v1, u);
+  if (u.empty() && !v1.empty()) {
+    // read 1 has hits with nothing in common, read 2 can't change that
+    return -1;
+  }
+  intersectECs(v2, tmp);
+  return intersectMates(v1, v2, u, tmp);
+}
+
+int MinCollector::intersectMates(const std::vector<EcDataPair>& v1,
+                          const std::vector<EcDataPair>& v2, std::vector<int> &u1,
+                          std::vector<int> &u2) const {
   if (u1.empty() && u2.empty()) {
     return -1;
   }
@@ -45,21 +57,20 @@ int MinCollector::intersectKmers(std::vector<EcDataPair>& v1,
   // non-strict intersection.
   if (u1.empty()) {
     if (v1.empty()) {
-      u = u2;
+      u1.swap(u2);
     } else {
       return -1;
     }
   } else if (u2.empty()) {
-    if (v2.empty()) {
-      u = u1;
-    } else {
+    if (!v2.empty()) {
+      u1.clear();
       return -1;
     }
   } else {
-    u = intersect(u1,u2);
+    intersectInPlace(u1, u2);
   }
 
-  if (u.empty()) {
+  if (u1.empty()) {
     return -1;
   }
   return 1;
@@ -146,58 +157,42 @@ struct ComparePairsBySecond {
 };
 
 std::vector<int> MinCollector::intersectECs(std::vector<EcDataPair>& v) const {
+  std::vector<int> u;
+  intersectECs(v, u);
+  return u;
+}
+
+void MinCollector::intersectECs(std::vector<EcDataPair>& v, std::vector<int>& u) const {
+  u.clear();
   if (v.empty()) {
-    return {};
+    return;
   }
-  sort(v.begin(), v.end(), [&](EcDataPair a, EcDataPair b) {
-    return std::tie(a.first.getData()->id, a.second) < std::tie(b.first.getData()->id, b.second);
-  });
 
-  int ec = v[0].first.getData()->id;
-  int lastEC = ec;
-  std::vector<int> u = index.ecmap[ec];
+  // hits on the same unitig are next to each other when they come from
+  // match, so one pass in read order skips the repeats and finds the range
+  int lastEC = v[0].first.getData()->id;
+  const auto& first = index.ecmap[lastEC];
+  u.assign(first.begin(), first.end());
+  int minpos = v[0].second;
+  int maxpos = v[0].second;
 
   for (int i = 1; i < v.size(); i++) {
-    if (v[i].first.getData()->id != v[i-1].first.getData()->id) {
-      ec = v[i].first.getData()->id;
-      if (ec != lastEC) {
-        u = index.intersect(ec, u);
-        lastEC = ec;
-        if (u.empty()) {
-          return u;
-        }
+    minpos = std::min(minpos, v[i].second);
+    maxpos = std::max(maxpos, v[i].second);
+    int ec = v[i].first.getData()->id;
+    if (ec != lastEC) {
+      index.intersectInPlace(ec, u);
+      lastEC = ec;
+      if (u.empty()) {
+        return;
       }
     }
   }
 
-  /*for (auto &x : vp) {
-    //tmp = index.intersect(x.first,u);
-    u = index.intersect(x.first,u);
-    //if (!tmp.empty()) {
-     // u = tmp;
-      //count++; // increase the count
-     // }
-  }*/
-
-  // if u is empty do nothing
-  /*if (u.empty()) {
-    return u;
-    }*/
-
-  // find the range of support
-  int minpos = std::numeric_limits<int>::max();
-  int maxpos = 0;
-
-  for (auto& x : v) {
-    minpos = std::min(minpos, x.second);
-    maxpos = std::max(maxpos, x.second);
-  }
-
+  // the range of support
   if ((maxpos-minpos + k) < min_range) {
-    return {};
+    u.clear();
   }
-
-  return u;
 }
 
 
@@ -340,37 +335,27 @@ void MinCollector::compute_mean_frag_lens_trunc(bool verbose)  {
 }
 
 int hexamerToInt(const char *s, bool revcomp) {
+  const uint8_t *code = baseCodes();
   int hex = 0;
-  if (!revcomp) {
-    for (int i = 0; i < 6; i++) {
-      hex <<= 2;
-      switch (*(s+i) & 0xDF) {
-      case 'A': break;
-      case 'C': hex += 1; break;
-      case 'G': hex += 2; break;
-      case 'T': hex += 3; break;
-      default: return -1;
-      }
+  for (int i = 0; i < 6; i++) {
+    int c = code[(uint8_t) s[i]];
+    if (c > 3) {
+      return -1;
     }
-  } else {
-    for (int i = 0; i < 6; i++) {
-      switch (*(s+i) & 0xDF) {
-      case 'A': hex += 3 << (2*i);break;
-      case 'C': hex += 2 << (2*i); break;
-      case 'G': hex += 1 << (2*i); break;
-      case 'T': break;
-      default: return -1;
-      }
+    if (!revcomp) {
+      hex = (hex << 2) | c;
+    } else {
+      hex |= (3 - c) << (2*i);
     }
   }
   return hex;
 }
 
-bool MinCollector::countBias(const char *s1, const char *s2, const std::vector<EcDataPair> v1, const std::vector<EcDataPair> v2, bool paired) {
+bool MinCollector::countBias(const char *s1, const char *s2, const std::vector<EcDataPair>& v1, const std::vector<EcDataPair>& v2, bool paired) {
   return countBias(s1,s2,v1,v2,paired,bias5);
 }
 
-bool MinCollector::countBias(const char *s1, const char *s2, const std::vector<EcDataPair> v1, const std::vector<EcDataPair> v2, bool paired, std::vector<int>& biasOut) const {
+bool MinCollector::countBias(const char *s1, const char *s2, const std::vector<EcDataPair>& v1, const std::vector<EcDataPair>& v2, bool paired, std::vector<int>& biasOut) const {
 
   const int pre = 2, post = 4;
 
@@ -380,7 +365,16 @@ bool MinCollector::countBias(const char *s1, const char *s2, const std::vector<E
 
   
 
-  auto getPreSeq = [&](const char *s, Bifrost::Kmer km, bool fw, bool csense, EcDataPair dat) -> int {
+  // the hexamer at position p of the unitig, read off the k-mer that covers
+  // it rather than converting the whole unitig to a string
+  auto unitigHexamer = [&](const EcDataPair& dat, int p, bool revcomp) -> int {
+    int q = std::min(p, dat.first.getData()->length - 1);
+    char buf[Bifrost::Kmer::MAX_K + 1];
+    dat.first.getUnitigKmer(q).toString(buf);
+    return hexamerToInt(buf + (p - q), revcomp);
+  };
+
+  auto getPreSeq = [&](const char *s, Bifrost::Kmer km, bool fw, bool csense, const EcDataPair& dat) -> int {
     const KmerEntry* val = dat.first.getData();
     if (s==0) {
       return -1;
@@ -391,11 +385,11 @@ bool MinCollector::countBias(const char *s1, const char *s2, const std::vector<E
       int hex = -1;
       //std::cout << "  " << s << "\n";
       if (csense) {
-        hex = hexamerToInt(dat.first.referenceUnitigToString().c_str() + (val->getPos() - dat.second - pre), true);
+        hex = unitigHexamer(dat, val->getPos() - dat.second - pre, true);
         //std::cout << c.seq.substr(val.getPos()- p - pre,6) << "\n";
       } else {
         int pos = (val->getPos() + dat.second) + k - post;
-        hex = hexamerToInt(dat.first.referenceUnitigToString().c_str() + (pos), false);
+        hex = unitigHexamer(dat, pos, false);
         //std::cout << revcomp(c.seq.substr(pos,6)) << "\n";
       }
       return hex;
@@ -50,8 +50,19 @@ struct MinCollector {
   int decreaseCount(const int ec);
 
   std::vector<int> intersectECs(std::vector<EcDataPair>& v) const;
+  // same as above but writes into u, reusing its storage
+  void intersectECs(std::vector<EcDataPair>& v, std::vector<int>& u) const;
   int intersectKmers(std::vector<EcDataPair>& v1,
                     std::vector<EcDataPair>& v2, bool nonpaired, std::vector<int> &u) const;
+  // tmp is scratch space, callers in the read loop keep it around between reads
+  int intersectKmers(std::vector<EcDataPair>& v1,
+                    std::vector<EcDataPair>& v2, bool nonpaired, std::vector<int> &u,
+                    std::vector<int> &tmp) const;
+  // combines u1 and u2, the intersectECs of v1 and v2, into the
+  // pseudoalignment of the pair, left in u1
+  int intersectMates(const std::vector<EcDataPair>& v1,
+                    const std::vector<EcDataPair>& v2, std::vector<int> &u1,
+                    std::vector<int> &u2) const;
   int findEC(const std::vector<int>& u) const;
 
 
@@ -66,8 +77,8 @@ struct MinCollector {
   void loadCounts(ProgramOptions& opt);
 
 
-  bool countBias(const char *s1, const char *s2, const std::vector<EcDataPair> v1, const std::vector<EcDataPair> v2, bool paired);
-  bool countBias(const char *s1, const char *s2, const std::vector<EcDataPair> v1, const std::vector<EcDataPair> v2, bool paired, std::vector<int>& biasOut) const;
+  bool countBias(const char *s1, const char *s2, const std::vector<EcDataPair>& v1, const std::vector<EcDataPair>& v2, bool paired);
+  bool countBias(const char *s1, const char *s2, const std::vector<EcDataPair>& v1, const std::vector<EcDataPair>& v2, bool paired, std::vector<int>& biasOut) const;
 
   // DEPRECATED
   double get_mean_frag_len(bool lenient = false) const;
@@ -94,6 +105,7 @@ struct MinCollector {
 };
 
 std::vector<int> intersect(const std::vector<int>& x, const std::vector<int>& y);
+void intersectInPlace(std::vector<int>& x, const std::vector<int>& y);
 
 int hexamerToInt(const char *s, bool revcomp);
 
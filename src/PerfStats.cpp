@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <mutex>
+
+#include "PerfStats.h"
+
+PerfCounters::PerfCounters() : kmer_lookups(0), kmer_hits(0), bytes_read(0),
+  input_seconds(0.0), reader_wait(0.0), writer_wait(0.0),
+  em_runs(0), em_iterations(0), em_seconds(0.0) {}
+
+PerfCounters& PerfCounters::operator+=(const PerfCounters& o) {
+  kmer_lookups += o.kmer_lookups;
+  kmer_hits += o.kmer_hits;
+  bytes_read += o.bytes_read;
+  input_seconds += o.input_seconds;
+  reader_wait += o.reader_wait;
+  writer_wait += o.writer_wait;
+  em_runs += o.em_runs;
+  em_iterations += o.em_iterations;
+  em_seconds += o.em_seconds;
+  return *this;
+}
+
+static std::mutex perf_lock;
+// counters of the live threads, and the sum of the ones that have exited
+static std::vector<PerfCounters*> perf_threads;
+static PerfCounters perf_exited;
+static std::vector<std::pair<std::string, double>> perf_stages;
+
+namespace {
+struct ThreadCounters {
+  PerfCounters c;
+
+  ThreadCounters() {
+    std::lock_guard<std::mutex> lock(perf_lock);
+    perf_threads.push_back(&c);
+  }
+
+  ~ThreadCounters() {
+    std::lock_guard<std::mutex> lock(perf_lock);
+    perf_exited += c;
+    perf_threads.erase(std::find(perf_threads.begin(), perf_threads.end(), &c));
+  }
+};
+}
+
+PerfCounters& PerfStats::local() {
+  static thread_local ThreadCounters t;
+  return t.c;
+}
+
+PerfCounters PerfStats::total() {
+  std::lock_guard<std::mutex> lock(perf_lock);
+  PerfCounters sum = perf_exited;
+  for (auto c : perf_threads) {
+    sum += *c;
+  }
+  return sum;
+}
+
+void PerfStats::addStage(const std::string& name, double seconds) {
+  std::lock_guard<std::mutex> lock(perf_lock);
+  for (auto& s : perf_stages) {
+    if (s.first == name) {
+      s.second += seconds;
+      return;
+    }
+  }
+  perf_stages.push_back({name, seconds});
+}
+
+std::vector<std::pair<std::string, double>> PerfStats::stages() {
+  std::lock_guard<std::mutex> lock(perf_lock);
+  return perf_stages;
+}
@@ -0,0 +1,80 @@
+#ifndef KALLISTO_PERFSTATS_H
+#define KALLISTO_PERFSTATS_H
+
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Counters for the performance section of run_info.json. Every thread has
+// its own copy and adds to it at most once per read or batch, the copies
+// are summed when the run info is written. Seconds here are summed over
+// threads, so they can exceed the wall time of the run.
+struct PerfCounters {
+  PerfCounters();
+
+  int64_t kmer_lookups;
+  int64_t kmer_hits;
+  int64_t bytes_read;    // input after decompression
+  double input_seconds;  // reading and decompressing the input
+  double reader_wait;    // waiting for the reader lock
+  double writer_wait;    // waiting for the writer lock
+  int64_t em_runs;
+  int64_t em_iterations;
+  double em_seconds;
+
+  PerfCounters& operator+=(const PerfCounters& o);
+};
+
+class PerfStats {
+public:
+  // the counters of the calling thread
+  static PerfCounters& local();
+  // sum over all threads, call once the work being measured is done
+  static PerfCounters total();
+
+  // adds wall time to a stage of the run, in seconds
+  static void addStage(const std::string& name, double seconds);
+  // the stages in the order they were first recorded
+  static std::vector<std::pair<std::string, double>> stages();
+};
+
+class PerfTimer {
+public:
+  PerfTimer() : start(std::chrono::steady_clock::now()) {}
+
+  double seconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point start;
+};
+
+// adds the wall time of its scope to a stage
+class PerfStage {
+public:
+  PerfStage(const std::string& name) : name(name) {}
+  ~PerfStage() {
+    PerfStats::addStage(name, timer.seconds());
+  }
+
+private:
+  std::string name;
+  PerfTimer timer;
+};
+
+// locks m and adds the time spent waiting for it to wait
+inline std::unique_lock<std::mutex> timedLock(std::mutex& m, double& wait) {
+  std::unique_lock<std::mutex> lock(m, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    PerfTimer timer;
+    lock.lock();
+    wait += timer.seconds();
+  }
+  return lock;
+}
+
+#endif // KALLISTO_PERFSTATS_H
@@ -1,4 +1,5 @@
 #include "PlaintextWriter.h"
+#include "PerfStats.h"
 #include <iomanip>
 #include <sstream>
 
@@ -100,17 +101,19 @@ void plaintext_aux(
     const std::string& version,
     const std::string& index_v,
     const std::string& start_time,
-    const std::string& call) {
+    const std::string& call,
+    double subsample) {
   std::ofstream of;
   of.open( out_name );
   
   double p_uniq =0.0;
   double p_aln = 0.0;
+  double nreads = 0.0;
   std::stringstream ss;
   std::string p_aln_s, p_uniq_s;
 
   try {
-    double nreads = std::stod(n_processed);
+    nreads = std::stod(n_processed);
     double naln = std::stod(n_pseudoaligned);
     double nuniq = std::stod(n_unique);
     if (nreads > 0) {
@@ -135,10 +138,48 @@ void plaintext_aux(
     to_json("p_pseudoaligned", p_aln_s, false) << std::endl << 
     to_json("p_unique", p_uniq_s, false) << std::endl << 
     to_json("kallisto_version", version, true) << std::endl <<
-    to_json("index_version", index_v, false) << std::endl <<
-    to_json("start_time", start_time, true) << std::endl <<
-    to_json("call", call, true, false) << std::endl <<
-    "}" << std::endl;
+    to_json("index_version", index_v, false) << std::endl;
+  if (subsample < 1.0) {
+    // reads were subsampled, n_processed only counts the ones kept
+    of << to_json("subsample", std::to_string(subsample), false) << std::endl;
+  }
+  auto stages = PerfStats::stages();
+  PerfCounters perf = PerfStats::total();
+  // nothing is measured when the run info is only converted
+  bool performance = !stages.empty() || perf.em_runs > 0;
+  of << to_json("start_time", start_time, true) << std::endl <<
+    to_json("call", call, true, performance) << std::endl;
+  if (performance) {
+    auto num = [](double x) {
+      std::stringstream ss;
+      ss << std::fixed << std::setprecision(3) << x;
+      return ss.str();
+    };
+    of << "\t\"performance\": {" << std::endl <<
+      "\t\t\"stage_seconds\": {" << std::endl;
+    double pseudoalignment = 0.0;
+    for (size_t i = 0; i < stages.size(); i++) {
+      of << to_json(stages[i].first, num(stages[i].second), false, i + 1 < stages.size(), 3) << std::endl;
+      if (stages[i].first == "pseudoalignment") {
+        pseudoalignment = stages[i].second;
+      }
+    }
+    double reads_per_second = (pseudoalignment > 0.0) ? nreads / pseudoalignment : 0.0;
+    // the seconds below are summed over threads
+    of << "\t\t}," << std::endl <<
+      to_json("reads_per_second", num(reads_per_second), false, true, 2) << std::endl <<
+      to_json("bytes_read", std::to_string(perf.bytes_read), false, true, 2) << std::endl <<
+      to_json("input_seconds", num(perf.input_seconds), false, true, 2) << std::endl <<
+      to_json("kmer_lookups", std::to_string(perf.kmer_lookups), false, true, 2) << std::endl <<
+      to_json("kmer_hits", std::to_string(perf.kmer_hits), false, true, 2) << std::endl <<
+      to_json("reader_lock_wait_seconds", num(perf.reader_wait), false, true, 2) << std::endl <<
+      to_json("writer_lock_wait_seconds", num(perf.writer_wait), false, true, 2) << std::endl <<
+      to_json("em_runs", std::to_string(perf.em_runs), false, true, 2) << std::endl <<
+      to_json("em_iterations", std::to_string(perf.em_iterations), false, true, 2) << std::endl <<
+      to_json("em_seconds", num(perf.em_seconds), false, false, 2) << std::endl <<
+      "\t}" << std::endl;
+  }
+  of << "}" << std::endl;
 
   of.close();
 }
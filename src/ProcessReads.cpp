@@ -16,11 +16,18 @@
 
 #include <fstream>
 #include <limits>
+#include <cmath>
 
 #include <iomanip>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "ProcessReads.h"
 #include "kseq.h"
+#include "SeqScan.h"
 #include "PseudoBam.h"
 #include "Fusion.hpp"
 #include "BUSData.h"
@@ -77,6 +84,78 @@ const int default_genome_auxlen = 7; // for ZW:f:0.0
 
 //methods
 
+// true unless one of the files is standard input or a pipe
+bool seekableInput(const std::vector<std::string>& files) {
+  for (const auto& fn : files) {
+    struct stat stFileInfo;
+    if (fn == "-" || stat(fn.c_str(), &stFileInfo) != 0 || S_ISFIFO(stFileInfo.st_mode)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// appends name, sequence and quality of every read to out, each null terminated
+static void packReads(std::string& out, const std::vector<std::pair<const char*, int>>& seqs,
+                      const std::vector<std::pair<const char*, int>>& names,
+                      const std::vector<std::pair<const char*, int>>& quals) {
+  for (int i = 0; i < seqs.size(); i++) {
+    out.append(names[i].first, names[i].second + 1);
+    out.append(seqs[i].first, seqs[i].second + 1);
+    out.append(quals[i].first, quals[i].second + 1);
+  }
+}
+
+// inverse of packReads, the views point into in
+static void unpackReads(std::string& in, std::vector<std::pair<const char*, int>>& seqs,
+                        std::vector<std::pair<const char*, int>>& names,
+                        std::vector<std::pair<const char*, int>>& quals) {
+  seqs.clear();
+  names.clear();
+  quals.clear();
+  const char *p = in.c_str();
+  const char *end = p + in.size();
+  while (p < end) {
+    int nlen = strlen(p);
+    names.emplace_back(p, nlen);
+    p += nlen + 1;
+    int slen = strlen(p);
+    seqs.emplace_back(p, slen);
+    p += slen + 1;
+    int qlen = strlen(p);
+    quals.emplace_back(p, qlen);
+    p += qlen + 1;
+  }
+}
+
+// keeps a read if its hashed read number falls below threshold, the hash
+// depends only on the read number so both mates get the same answer and
+// repeated runs subsample the same reads
+static inline bool keepRead(uint32_t read, uint64_t threshold) {
+  uint64_t x = read + 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  x = x ^ (x >> 31);
+  return (x >> 11) < threshold;
+}
+
+// trims adapter read-through and poly-A tails off the 3' end of a read so
+// their k-mers are never looked up, returns the new length. the read is
+// terminated at the new end since the k-mer iterator stops at '\0'
+static int trimRead(const char *s, int l, const ProgramOptions& opt) {
+  int n = l;
+  if (!opt.adapter.empty()) {
+    n = findAdapter(s, n, opt.adapter.c_str(), opt.adapter.size(), 8);
+  }
+  if (opt.trim_polya) {
+    n = trimPolyA(s, n, 10);
+  }
+  if (n < l) {
+    const_cast<char*>(s)[n] = '\0'; // the reads live in our own buffer
+  }
+  return n;
+}
+
 int64_t ProcessBatchReads(MasterProcessor& MP, const ProgramOptions& opt) {
   int limit = 1048576; 
   std::vector<std::pair<const char*, int>> seqs;
@@ -108,7 +187,7 @@ int64_t ProcessBatchReads(MasterProcessor& MP, const ProgramOptions& opt) {
       }
     }
   }
-  
+
   std::cerr << "[quant] finding pseudoalignments for all files ..."; std::cerr.flush();
   
   MP.processReads();
@@ -163,6 +242,10 @@ int64_t ProcessReads(MasterProcessor& MP, const  ProgramOptions& opt) {
     }
   }
 
+  if (opt.subsample < 1.0) {
+    std::cerr << "[quant] subsampling " << (100.0 * opt.subsample) << "% of the fragments" << std::endl;
+  }
+
   // for each file
   std::cerr << "[quant] finding pseudoalignments for the reads ..."; std::cerr.flush();
   if (opt.verbose) {
@@ -184,6 +267,16 @@ int64_t ProcessReads(MasterProcessor& MP, const  ProgramOptions& opt) {
     std::cerr << " done" << std::endl;
   }
 
+  if (opt.verbose && opt.dedup > 0 && MP.dedup_lookups > 0) {
+    std::cerr << "[quant] " << pretty_num((int64_t) MP.dedup_hits) << " of " << pretty_num((int64_t) MP.dedup_lookups)
+              << " reads were answered by the duplicate read cache" << std::endl;
+  }
+
+  if (MP.saturated) {
+    std::cerr << "[quant] equivalence class proportions converged, stopped after "
+              << pretty_num(numreads) << " reads" << std::endl;
+  }
+
   //std::cout << "betterCount = " << betterCount << ", out of betterCand = " << betterCand << std::endl;
 
   if (opt.bias) {
@@ -322,42 +415,55 @@ int64_t ProcessBUSReads(MasterProcessor& MP, const  ProgramOptions& opt) {
 
 /** -- read processors -- **/
 
+// appends the number of distinct UMIs of each EC to bc, umis is sorted
+static void countUMIs(const std::vector<std::pair<int, uint64_t>>& umis,
+                      std::vector<std::pair<int32_t, int32_t>>& bc) {
+  size_t first = bc.size();
+  for (size_t j = 0; j < umis.size(); j++) {
+    if (j > 0 && umis[j-1] == umis[j]) {
+      continue;
+    }
+    if (bc.size() > first && bc.back().first == umis[j].first) {
+      ++bc.back().second;
+    } else {
+      bc.push_back({umis[j].first, 1});
+    }
+  }
+}
+
 void MasterProcessor::processReads() {
-  
+  PerfStage stage("pseudoalignment");
 
   // start worker threads
+  ThreadPool& pool = ThreadPool::shared(opt.threads);
   if (!opt.batch_mode && !opt.bus_mode) {
-    std::vector<std::thread> workers;
+    TaskGroup workers(pool);
     for (int i = 0; i < opt.threads; i++) {
-      workers.emplace_back(std::thread(ReadProcessor(index,opt,tc,*this)));
+      auto rp = std::make_shared<ReadProcessor>(index,opt,tc,*this);
+      workers.run([rp]() { (*rp)(); });
     }
     
     // let the workers do their thing
-    for (int i = 0; i < opt.threads; i++) {
-      workers[i].join(); //wait for them to finish
-    }
-
-    // now handle the modification of the mincollector
-    for (auto &t : newECcount) {
-      if (t.second <= 0) {
-        continue;
-      }
-      int ec = tc.increaseCount(t.first); // modifies the ecmap
-
-      if (ec != -1 && t.second > 1) {
-        tc.counts[ec] += (t.second-1);
-      }
+    workers.wait();
+
+    // now handle the modification of the mincollector, the new ECs were
+    // handed out ids in order and their counts are already merged
+    int offset = new_ecs.offset();
+    tc.counts.resize(offset + new_ecs.size(), 0);
+    for (int i = 0; i < new_ecs.size(); i++) {
+      const auto &u = new_ecs.get(i);
+      index.ecmap.push_back(u);
+      index.ecmapinv.insert({u, offset + i});
     }
   } else if (opt.bus_mode) {
-    std::vector<std::thread> workers;
+    TaskGroup workers(pool);
     for (int i = 0; i < opt.threads; i++) {
-      workers.emplace_back(std::thread(BUSProcessor(index,opt,tc,*this)));
+      auto bp = std::make_shared<BUSProcessor>(index,opt,tc,*this);
+      workers.run([bp]() { (*bp)(); });
     }
     
     // let the workers do their thing
-    for (int i = 0; i < opt.threads; i++) {
-      workers[i].join(); //wait for them to finish
-    }
+    workers.wait();
 
     // now handle the modification of the mincollector
     for (int i = 0; i < bus_ecmap.size(); i++) {
@@ -374,64 +480,30 @@ void MasterProcessor::processReads() {
 
   
   } else if (opt.batch_mode) {    
-    std::vector<std::thread> workers;
     int num_ids = opt.batch_ids.size();
-    int id =0;
-    tmp_bc.assign(opt.threads, {});
-    while (id < num_ids) {
-      // TODO: put in thread pool
-      workers.clear();
-      int nt = std::min(opt.threads, (num_ids - id));
-      int first_id = id;
-      for (int i = 0; i < nt; i++,id++) {
-        tmp_bc[i].assign(tc.counts.size(), 0);     
-        workers.emplace_back(std::thread(ReadProcessor(index, opt, tc, *this, id,i)));
-      }
-      
-      for (int i = 0; i < nt; i++) {
-        workers[i].join();
-      }
-      
-      if (!opt.umi) {
-        for (int i = 0; i < nt; i++) {
-          auto &bc = batchCounts[first_id+i];
-          auto &tmp_c = tmp_bc[i];
-          for (int j = 0; j < tmp_c.size(); j++) {
-            if (tmp_c[j] > 0) {
-              bc.push_back({j, tmp_c[j]});
-            }
-          }
+    // cells are started in order, a worker with no cell left to start
+    // joins the oldest cell that is still being read
+    std::atomic<int> next_id(0);
+    auto processCell = [this](int id) {
+      if (joinBatchCell(id)) {
+        ReadProcessor rp(index, opt, tc, *this, id);
+        rp();
+      }
+    };
+    TaskGroup workers(pool);
+    for (int i = 0; i < opt.threads; i++) {
+      workers.run([&next_id, num_ids, processCell]() {
+        int id;
+        while ((id = next_id++) < num_ids) {
+          processCell(id);
         }
-      } else {
-        std::vector<int32_t> tmp_counts;
-        tmp_counts.resize(tc.counts.size(), 0);
-        // process the regular EC umi now
-        for (int i = 0; i < nt; i++) {
-          tmp_counts.assign(tmp_counts.size(), 0);
-          int l_id = id - nt + i;
-          auto &umis = batchUmis[l_id];
-          std::sort(umis.begin(), umis.end());
-          size_t sz = umis.size();
-          nummapped += sz;
-          if (sz > 0) {
-            ++tmp_counts[umis[0].first];
-          }
-          for (int j = 1; j < sz; j++) {
-            if (umis[j-1] != umis[j]) {
-              ++tmp_counts[umis[j].first];
-            }
-          }
-          auto &bc = batchCounts[l_id];
-          bc.clear();
-          for (int j = 0; j < tmp_counts.size(); j++) {
-            if (tmp_counts[j] > 0) {
-              bc.push_back({j, tmp_counts[j]});
-            }
-          }
-          umis.clear();
+        for (id = 0; id < num_ids; id++) {
+          processCell(id);
         }
-      }
+      });
     }
+    workers.wait();
+    batchCells.clear();
     
     int num_newEcs = 0;
     if (!opt.umi) {      
@@ -451,10 +523,9 @@ void MasterProcessor::processReads() {
         }
       }
       // for each cell
-      std::vector<int> tmp_counts;
-      tmp_counts.resize(tc.counts.size(), 0);
+      SparseCounts new_counts;
+      SparseCounts::Pairs tmp_counts;
       for (int id = 0; id < num_ids; id++) {
-        tmp_counts.assign(tmp_counts.size(), 0);
         // for each new ec
         for (auto &t : newBatchECcount[id]) {
           // count the ec
@@ -463,14 +534,12 @@ void MasterProcessor::processReads() {
           }
           int ec = tc.findEC(t.first);
           assert(ec != -1);
-          ++tmp_counts[ec];
+          new_counts.add(ec);
         }
+        // the new ECs come after the ones already counted
+        new_counts.release(tmp_counts);
         auto& bc = batchCounts[id];
-        for (int j = 0; j < tmp_counts.size(); j++) {
-          if (tmp_counts[j] > 0) {
-            bc.push_back({j,tmp_counts[j]});
-          }
-        }
+        bc.insert(bc.end(), tmp_counts.begin(), tmp_counts.end());
       }
     } else {
       // UMI case
@@ -488,12 +557,9 @@ void MasterProcessor::processReads() {
         }
       }
       
-      std::vector<int> tmp_counts;
-      tmp_counts.resize(tc.counts.size(), 0);
       // for each cell
       for (int id = 0; id < num_ids; id++) {
-        tmp_counts.assign(tmp_counts.size(), 0);
-        std::vector<std::pair<int, std::string>> umis;
+        std::vector<std::pair<int, uint64_t>> umis;
         umis.reserve(newBatchECumis[id].size());
         // for each new ec
         for (auto &t : newBatchECumis[id]) {
@@ -503,22 +569,9 @@ void MasterProcessor::processReads() {
         }
         // find unique umis per ec
         std::sort(umis.begin(), umis.end());
-        size_t sz = umis.size();
-        if (sz > 0) {
-          ++tmp_counts[umis[0].first];
-        }
-        for (int j = 1; j < sz; j++) {
-          if (umis[j-1] != umis[j]) {
-            ++tmp_counts[umis[j].first];
-          }
-        }
-        
+        // the new ECs come after the ones already counted
         auto& bc = batchCounts[id];
-        for (int j = 0; j < tmp_counts.size(); j++) {
-          if (tmp_counts[j] > 0) {
-            bc.push_back({j,tmp_counts[j]});
-          }
-        }
+        countUMIs(umis, bc);
         for (auto x : bc) {
           num_umi += x.second;
         }
@@ -527,6 +580,7 @@ void MasterProcessor::processReads() {
   }
 
   if (opt.pseudobam) {
+    pseudobatch_writer->finish();
     pseudobatchf_out.close();
   }
   if (opt.bus_mode) {
@@ -535,6 +589,7 @@ void MasterProcessor::processReads() {
 }
 
 void MasterProcessor::processAln(const EMAlgorithm& em, bool useEM = true) {
+  PerfStage stage("pseudobam");
   // open bamfile and fetch header
   std::string bamfn = opt.output + "/pseudoalignments.bam";
   if (opt.pseudobam) {
@@ -624,17 +679,18 @@ void MasterProcessor::processAln(const EMAlgorithm& em, bool useEM = true) {
 
   assert(opt.pseudobam);
   pseudobatchf_in.open(opt.output + "/pseudoaln.bin", std::ios::in | std::ios::binary);
-  SR->reset();
+  if (!store_reads) {
+    SR->reset();
+  }
 
-  std::vector<std::thread> workers;
+  TaskGroup workers(ThreadPool::shared(opt.threads));
   for (int i = 0; i < opt.threads; i++) {
-    workers.emplace_back(std::thread(AlnProcessor(index,opt,*this, em, model, useEM)));
+    auto ap = std::make_shared<AlnProcessor>(index,opt,*this, em, model, useEM);
+    workers.run([ap]() { (*ap)(); });
   }
   
   // let the workers do their thing
-  for (int i = 0; i < opt.threads; i++) {
-    workers[i].join(); //wait for them to finish
-  }
+  workers.wait();
 
   pseudobatchf_in.close();
   remove((opt.output + "/pseudoaln.bin").c_str());
@@ -730,35 +786,33 @@ void MasterProcessor::processAln(const EMAlgorithm& em, bool useEM = true) {
 }
 
 void MasterProcessor::update(const std::vector<int>& c, const std::vector<std::vector<int> > &newEcs, 
-                            std::vector<std::pair<int, std::string>>& ec_umi, std::vector<std::pair<std::vector<int>, std::string>> &new_ec_umi, 
-                            int n, std::vector<int>& flens, std::vector<int> &bias, const PseudoAlignmentBatch& pseudobatch, std::vector<BUSData> &bv, std::vector<std::pair<BUSData, std::vector<int32_t>>> newBP, int *bc_len, int *umi_len,  int id, int local_id) {
+                            std::vector<std::pair<int, uint64_t>>& ec_umi, std::vector<std::pair<std::vector<int>, uint64_t>> &new_ec_umi, 
+                            int n, std::vector<int>& flens, std::vector<int> &bias, PseudoAlignmentBatch& pseudobatch, std::vector<BUSData> &bv, std::vector<std::pair<BUSData, std::vector<int32_t>>> newBP, int *bc_len, int *umi_len,  int id, int local_id) {
   // acquire the writer lock
-  std::lock_guard<std::mutex> lock(this->writer_lock);
+  auto lock = timedLock(writer_lock, PerfStats::local().writer_wait);
 
   if (!opt.batch_mode) {
-    for (int i = 0; i < c.size(); i++) {
-      tc.counts[i] += c[i]; // add up ec counts
-      nummapped += c[i];
-    }
-  } else {
-    if (!opt.umi) {
-      auto& bc = tmp_bc[local_id];
-      for (int i = 0; i < c.size(); i++) {
-        bc[i] += c[i];
-        nummapped += c[i];
+    if (opt.saturation > 0.0) {
+      if (saturation_counts.empty()) {
+        saturation_counts.assign(tc.counts.size(), 0);
       }
-    } else {
-      for (auto &t : ec_umi) {
-        batchUmis[id].push_back(std::move(t));
+      for (auto ec : c) {
+        if ((size_t) ec >= saturation_counts.size()) {
+          saturation_counts.resize(ec + 1, 0);
+        }
+        ++saturation_counts[ec];
       }
-    }    
+      saturation_total += c.size();
+    }
+  } else if (opt.umi) {
+    for (auto &t : ec_umi) {
+      batchUmis[id].push_back(std::move(t));
+    }
   }
 
-  if (!opt.batch_mode) {
-    for(auto &u : newEcs) {
-      ++newECcount[u];
-    }
-  } else {
+  // outside of batch mode quant registers new ECs in new_ecs as it finds
+  // them and BUS mode keeps them with their records, see newB
+  if (opt.batch_mode) {
     if (!opt.umi) {
       for(auto &u : newEcs) {
         ++newBatchECcount[id][u];
@@ -805,26 +859,8 @@ void MasterProcessor::update(const std::vector<int>& c, const std::vector<std::v
   }
 
   if (opt.pseudobam) {
-    // copy the pseudo alignment information, either write to disk or queue up
-    pseudobatch_stragglers.push_back(std::move(pseudobatch));
-    while (true) {
-      if (pseudobatch_stragglers.empty()) {
-        break;
-      }
-      // find the smallest batch id
-      auto min_it = std::min_element(pseudobatch_stragglers.begin(), pseudobatch_stragglers.end(), 
-      [](const PseudoAlignmentBatch &p1, const PseudoAlignmentBatch &p2) -> bool {
-        return p1.batch_id < p2.batch_id;
-      });      
-      if ((last_pseudobatch_id + 1) != min_it->batch_id) {
-        break;
-      }
-      // if it is in sequence, write it out
-      writePseudoAlignmentBatch(pseudobatchf_out, *min_it);
-      // remove from processing
-      pseudobatch_stragglers.erase(min_it); 
-      last_pseudobatch_id += 1;
-    }
+    // written out in order by the writer thread
+    pseudobatch_writer->push(std::move(pseudobatch));
   }
 
   if (opt.bus_mode) {
@@ -868,11 +904,107 @@ void MasterProcessor::update(const std::vector<int>& c, const std::vector<std::v
   }
 
   numreads += n;
+
+  if (opt.saturation > 0.0 && !opt.batch_mode && !opt.bus_mode && numreads >= next_saturation_check) {
+    checkSaturation();
+  }
   // releases the lock
 }
 
+void MasterProcessor::mergeCounts(const std::vector<int>& c) {
+  auto lock = timedLock(writer_lock, PerfStats::local().writer_wait);
+  auto &dst = tc.counts;
+  if (dst.size() < c.size()) {
+    dst.resize(c.size(), 0); // ECs from new_ecs
+  }
+  for (int i = 0; i < c.size(); i++) {
+    dst[i] += c[i];
+    nummapped += c[i];
+  }
+}
+
+void MasterProcessor::mergeCounts(SparseCounts& c, int id) {
+  BatchCell& cell = *batchCells[id];
+  int64_t n = c.total();
+  bool last;
+  {
+    std::lock_guard<std::mutex> lock(cell.lock);
+    cell.counts.add(c);
+    // processors only leave a cell once it has been read to the end
+    last = (--cell.active == 0);
+  }
+  c.clear();
+  {
+    auto lock = timedLock(writer_lock, PerfStats::local().writer_wait);
+    nummapped += n;
+  }
+  if (last) {
+    finishBatchCell(id);
+  }
+}
+
+bool MasterProcessor::joinBatchCell(int id) {
+  BatchCell& cell = *batchCells[id];
+  std::lock_guard<std::mutex> lock(cell.lock);
+  if (cell.exhausted) {
+    return false;
+  }
+  ++cell.active;
+  return true;
+}
+
+// every update for the cell has been made by now, only the thread that
+// finishes it touches its counts and UMIs
+void MasterProcessor::finishBatchCell(int id) {
+  BatchCell& cell = *batchCells[id];
+  auto &bc = batchCounts[id];
+  if (!opt.umi) {
+    cell.counts.release(bc);
+  } else {
+    // process the regular EC umi now
+    auto &umis = batchUmis[id];
+    std::sort(umis.begin(), umis.end());
+    size_t sz = umis.size();
+    bc.clear();
+    countUMIs(umis, bc);
+    std::vector<std::pair<int, uint64_t>>().swap(umis);
+    {
+      auto lock = timedLock(writer_lock, PerfStats::local().writer_wait);
+      nummapped += sz;
+    }
+  }
+}
+
+// compares the EC proportions to the ones seen at the previous check and
+// tells the workers to stop reading once the L1 distance drops below
+// opt.saturation. ECs found since the last check count as zero there.
+// called with the writer lock held.
+void MasterProcessor::checkSaturation() {
+  next_saturation_check = numreads + saturationInterval;
+  if (saturation_total == 0) {
+    return;
+  }
+
+  if (saturation_snapshot_total > 0) {
+    // L1 distance between the EC proportions now and at the last check
+    double a = 1.0 / saturation_total;
+    double b = 1.0 / saturation_snapshot_total;
+    size_t n = saturation_snapshot.size();
+    double d = 0.0;
+    for (size_t i = 0; i < saturation_counts.size(); i++) {
+      d += std::fabs(saturation_counts[i] * a - ((i < n) ? saturation_snapshot[i] * b : 0.0));
+    }
+    if (d < opt.saturation) {
+      saturated = true;
+    }
+  }
+  // runs under the writer lock, assign reuses the snapshot's storage
+  saturation_snapshot.assign(saturation_counts.begin(), saturation_counts.end());
+  saturation_snapshot_total = saturation_total;
+}
+
 void MasterProcessor::writePseudoBam(const std::vector<bam1_t> &bv) {
-  std::lock_guard<std::mutex> lock(this->writer_lock);
+  auto lock = timedLock(writer_lock, PerfStats::local().writer_wait);
   // locking is handled by htslib
   //kstring_t str = { 0, 0, NULL };
   for (const auto &b : bv) {
@@ -899,7 +1031,7 @@ void MasterProcessor::writeSortedPseudobam(const std::vector<std::vector<bam1_t>
   assert(bvv.size() == numSortFiles);
   
   for (int i = 0; i < numSortFiles; i++) {
-    std::lock_guard<std::mutex> lock(this->writer_lock);
+    auto lock = timedLock(writer_lock, PerfStats::local().writer_wait);
     for (const auto &b : bvv[i]) {
       int r = sam_write1(bamfps[i], bamh, &b);
     }
@@ -909,7 +1041,7 @@ void MasterProcessor::writeSortedPseudobam(const std::vector<std::vector<bam1_t>
 void MasterProcessor::outputFusion(const std::stringstream &o) {
   std::string os = o.str();
   if (!os.empty()) {
-    std::lock_guard<std::mutex> lock(this->writer_lock);
+    auto lock = timedLock(writer_lock, PerfStats::local().writer_wait);
     ofusion << os << "\n";
   }
 }
@@ -923,13 +1055,8 @@ ReadProcessor::ReadProcessor(const KmerIndex& index, const ProgramOptions& opt,
 
    if (opt.batch_mode) {
      assert(id != -1);
-     batchSR.files = opt.batch_files[id];
-     batchSR.nfiles = opt.batch_files[id].size();
-     batchSR.reserveNfiles(opt.batch_files[id].size());
-     if (opt.umi) {
-       batchSR.umi_files = {opt.umi_files[id]};
-     }
-     batchSR.paired = !opt.single_end;
+   } else {
+     counts.assign(tc.counts.size(), 0); // kept for the whole run
    }
 
    seqs.reserve(bufsize/50);
@@ -937,7 +1064,11 @@ ReadProcessor::ReadProcessor(const KmerIndex& index, const ProgramOptions& opt,
     umis.reserve(bufsize/50);
    }
    newEcs.reserve(1000);
-   counts.reserve((int) (tc.counts.size() * 1.25));
+   v1.reserve(1000);
+   v2.reserve(1000);
+   u.reserve(1000);
+   utmp.reserve(1000);
+   vtmp.reserve(1000);
    clear();
 }
 
@@ -958,8 +1089,13 @@ ReadProcessor::ReadProcessor(ReadProcessor && o) :
   newEcs(std::move(o.newEcs)),
   flens(std::move(o.flens)),
   bias5(std::move(o.bias5)),
-  batchSR(std::move(o.batchSR)),
-  counts(std::move(o.counts)) {
+  counts(std::move(o.counts)),
+  cell_counts(std::move(o.cell_counts)),
+  v1(std::move(o.v1)),
+  v2(std::move(o.v2)),
+  u(std::move(o.u)),
+  utmp(std::move(o.utmp)),
+  vtmp(std::move(o.vtmp)) {
     buffer = o.buffer;
     o.buffer = nullptr;
     o.bufsize = 0;
@@ -975,18 +1111,40 @@ ReadProcessor::~ReadProcessor() {
 void ReadProcessor::operator()() {
   while (true) {
     int readbatch_id;
+    if (mp.saturated) {
+      break;
+    }
     // grab the reader lock
     if (mp.opt.batch_mode) {
-      if (batchSR.empty()) {
-        return;
+      // other workers may be reading the same cell
+      BatchCell& cell = *mp.batchCells[id];
+      auto lock = timedLock(cell.lock, PerfStats::local().reader_wait);
+      if (cell.exhausted) {
+        break;
+      } else if (cell.SR->empty()) {
+        // close the files and free the read-ahead buffers now rather than
+        // when the whole batch is done
+        cell.exhausted = true;
+        cell.SR.reset();
+        break;
       } else {
-        batchSR.fetchSequences(buffer, bufsize, seqs, names, quals, flags, umis, readbatch_id, mp.opt.pseudobam );
+        cell.SR->fetchSequences(buffer, bufsize, seqs, names, quals, flags, umis, readbatch_id, mp.opt.pseudobam );
+        readbatch_id = mp.next_pseudobatch_id++;
+      }
+    } else if (mp.SR->chunked()) {
+      {
+        auto lock = timedLock(mp.reader_lock, PerfStats::local().reader_wait);
+        if (!mp.SR->claimChunk(chunk, bufsize, readbatch_id)) {
+          break;
+        }
       }
+      // parse outside of the lock, the records are already ours
+      mp.SR->parseChunk(chunk, buffer, seqs, names, quals, flags, mp.opt.pseudobam || mp.opt.fusion);
     } else {
-      std::lock_guard<std::mutex> lock(mp.reader_lock);
+      auto lock = timedLock(mp.reader_lock, PerfStats::local().reader_wait);
       if (mp.SR->empty()) {
         // nothing to do
-        return;
+        break;
       } else {
         // get new sequences
         mp.SR->fetchSequences(buffer, bufsize, seqs, names, quals, flags, umis, readbatch_id, mp.opt.pseudobam || mp.opt.fusion);
@@ -995,116 +1153,174 @@ void ReadProcessor::operator()() {
     }
     pseudobatch.aln.clear();
     pseudobatch.batch_id = readbatch_id;
+    pseudobatch.reads.clear();
+    if (mp.store_reads) {
+      packReads(pseudobatch.reads, seqs, names, quals);
+    }
     // process our sequences
     processBuffer();
 
     // update the results, MP acquires the lock
     std::vector<BUSData> tmp_v{};
-    mp.update(counts, newEcs, ec_umi, new_ec_umi, paired ? seqs.size()/2 : seqs.size(), flens, bias5, pseudobatch, tmp_v, std::vector<std::pair<BUSData, std::vector<int32_t>>>{}, nullptr, nullptr, id, local_id);
+    mp.update(ec_hits, newEcs, ec_umi, new_ec_umi, numreads, flens, bias5, pseudobatch, tmp_v, std::vector<std::pair<BUSData, std::vector<int32_t>>>{}, nullptr, nullptr, id, local_id);
+    if (!mp.opt.batch_mode && mp.SR->chunked()) {
+      mp.SR->releaseChunk(chunk);
+    }
     clear();
   }
+  if (mp.opt.batch_mode) {
+    mp.mergeCounts(cell_counts, id);
+  } else {
+    mp.mergeCounts(counts);
+  }
 }
 
-void ReadProcessor::processBuffer() {
-  // set up thread variables  
-  std::vector<EcDataPair> v1, v2;
-  std::vector<int> vtmp;
-  std::vector<int> u;
-
-
-  u.reserve(1000);
-  v1.reserve(1000);
-  v2.reserve(1000);
-  vtmp.reserve(1000);
-
+template <bool PAIRED, bool STRANDED, bool PSEUDOBAM, bool COLLECT>
+void ReadProcessor::processLoop(bool findFragmentLength, int flengoal, bool findBias, int biasgoal) {
+  // set up thread variables, the k-mer and target vectors are members
+  // so reads never allocate for them
   const char* s1 = 0;
   const char* s2 = 0;
   int l1,l2;
 
-  bool findFragmentLength = (mp.opt.fld == 0) && (mp.tlencount < 10000);
-  if (mp.opt.batch_mode) {
-    findFragmentLength = (mp.opt.fld == 0) && (mp.tlencounts[id] < 10000);
-  }
-
-  int flengoal = 0;
-  flens.clear();
-  if (findFragmentLength) {
-    flengoal = (10000 - mp.tlencount);
-    if (flengoal <= 0) {
-      findFragmentLength = false;
-      flengoal = 0;
-    } else {
-      flens.resize(tc.flens.size(), 0);
-    }
-  }
-
-  int maxBiasCount = 0;
-  bool findBias = mp.opt.bias && (mp.biasCount < mp.maxBiasCount);
-
-
-  int biasgoal  = 0;
-  bias5.clear();
-  if (findBias) {
-    biasgoal = (mp.maxBiasCount - mp.biasCount);
-    if (biasgoal <= 0) {
-      findBias = false;
-    } else {
-      bias5.resize(tc.bias5.size(),0);
-    }
-  }
+  // reads are kept with probability subsample, 53 bits of the hash are used
+  bool subsample = mp.opt.subsample < 1.0;
+  uint64_t keep_threshold = (uint64_t) (mp.opt.subsample * (double) (1ULL << 53));
+  bool trim = mp.opt.trim_polya || !mp.opt.adapter.empty();
+  bool track_hits = mp.opt.saturation > 0.0 && !mp.opt.batch_mode;
+  bool use_registry = !mp.opt.batch_mode && !mp.opt.umi;
 
+  // identical reads get the same pseudoalignment unless we need the k-mer
+  // matches themselves for bias, fragment lengths, fusions or pseudobam
+  bool use_dedup = mp.opt.dedup > 0 && !findBias && !findFragmentLength && !mp.opt.fusion && !PSEUDOBAM;
+  std::string key;
+  int64_t dedup_lookups = 0, dedup_hits = 0;
 
   // actually process the sequences
   for (int i = 0; i < seqs.size(); i++) {
     s1 = seqs[i].first;
     l1 = seqs[i].second;
-    if (paired) {
+    if (PAIRED) {
       i++;
       s2 = seqs[i].first;
       l2 = seqs[i].second;
     }
 
+    if (subsample && !keepRead(flags[PAIRED ? i/2 : i], keep_threshold)) {
+      continue;
+    }
+
+    if (trim) {
+      l1 = trimRead(s1, l1, mp.opt);
+      if (PAIRED) {
+        l2 = trimRead(s2, l2, mp.opt);
+      }
+    }
+
     numreads++;
+    // checked before the read is mapped so that reads answered from the
+    // dedup cache, which skip the rest of the loop, are reported as well
+    if (mp.opt.verbose && numreads % 1000000 == 0) {
+      int nmap = mp.nummapped + cell_counts.total();
+      for (int i = 0; i < counts.size(); i++) {
+        nmap += counts[i];
+      }
+      nmap += newEcs.size();
+
+      std::cerr << '\r' << (numreads/1000000) << "M reads processed (" 
+        << std::fixed << std::setw( 3 ) << std::setprecision( 1 ) << ((100.0*nmap)/double(numreads))
+        << "% pseudoaligned)"; std::cerr.flush();
+    }
     v1.clear();
     v2.clear();
     u.clear();
 
-    // process read
-    index.match(s1,l1, v1);
-    if (paired) {
-      index.match(s2,l2, v2);
+    if (use_dedup) {
+      key.assign(s1, l1);
+      if (PAIRED) {
+        key.push_back('\n');
+        key.append(s2, l2);
+      }
+      ++dedup_lookups;
+      auto it = dedup.find(key);
+      if (it != dedup.end()) {
+        ++dedup_hits;
+        const auto &d = it->second;
+        if (d.u.empty()) {
+          continue;
+        }
+        if (!mp.opt.umi) {
+          if (!knownEC(d.ec)) {
+            newEcs.push_back(d.u);
+          } else {
+            countEC(d.ec);
+            if (track_hits) {
+              ec_hits.push_back(d.ec);
+            }
+          }
+        } else {
+          if (!knownEC(d.ec)) {
+            new_ec_umi.emplace_back(d.u, std::move(umis[i]));
+          } else {
+            ec_umi.emplace_back(d.ec, std::move(umis[i]));
+          }
+        }
+        continue;
+      }
+    }
+
+    // process read, fusion detection needs every k-mer hit to place the split
+    index.match(s1,l1, v1, !mp.opt.fusion);
+    tc.intersectECs(v1, u);
+    utmp.clear();
+    // if read 1 has hits with no target in common the pair can't map, so
+    // read 2 is only looked up when fusion detection wants it
+    if (PAIRED && (!u.empty() || v1.empty() || mp.opt.fusion)) {
+      index.match(s2,l2, v2, !mp.opt.fusion);
+      tc.intersectECs(v2, utmp);
     }
 
     // collect the target information
     int ec = -1;
-    int r = tc.intersectKmers(v1, v2, !paired,u);
+    tc.intersectMates(v1, v2, u, utmp);
     if (u.empty()) {
       if (mp.opt.fusion && !(v1.empty() || v2.empty())) {
-        searchFusion(index,mp.opt,tc,mp,ec,names[i-1].first,s1,v1,names[i].first,s2,v2,paired);
+        searchFusion(index,mp.opt,tc,mp,ec,names[i-1].first,s1,v1,names[i].first,s2,v2,PAIRED);
       }
     } else {
       ec = tc.findEC(u);
     }
 
+    // the first k-mer hit of each read, only looked up when something below
+    // needs it
+    bool fl_filter = !mp.opt.single_overhang && !mp.opt.umi && !u.empty() && (!PAIRED || v1.empty() || v2.empty()) && tc.has_mean_fl;
+    EcDataPair first1, first2;
+    if (!u.empty() && (STRANDED || PSEUDOBAM || (COLLECT && findFragmentLength) || fl_filter)) {
+      if (!v1.empty()) {
+        first1 = findFirstMappingKmer(v1);
+      }
+      if (!v2.empty()) {
+        first2 = findFirstMappingKmer(v2);
+      }
+    }
 
     /* --  possibly modify the pseudoalignment  -- */
 
     // If we have paired end reads where one end maps or single end reads, check if some transcsripts
     // are not compatible with the mean fragment length
-    if (!mp.opt.single_overhang && !mp.opt.umi && !u.empty() && (!paired || v1.empty() || v2.empty()) && tc.has_mean_fl) {
+    if (fl_filter) {
       vtmp.clear();
       // inspect the positions
       int fl = (int) tc.get_mean_frag_len();
-      int p = -1;
       EcDataPair val;
       Bifrost::Kmer km;
 
       if (!v1.empty()) {
-        val = findFirstMappingKmer(v1);
+        val = first1;
         km = Bifrost::Kmer(s1 + val.second);
       }
       if (!v2.empty()) {
-        val = findFirstMappingKmer(v2);
+        val = first2;
         km = Bifrost::Kmer(s2 + val.second);
       }
 
@@ -1125,18 +1341,18 @@ void ReadProcessor::processBuffer() {
       }
 
       if (vtmp.size() < u.size()) {
-        u = vtmp; // copy
+        u.swap(vtmp);
       }
     }
     
-    if (mp.opt.strand_specific && !u.empty()) {
+    if (STRANDED && !u.empty()) {
       Bifrost::Kmer km;
       EcDataPair val;
       val.second = -1;
       if (!v1.empty()) {
         vtmp.clear();
         bool firstStrand = (mp.opt.strand == ProgramOptions::StrandType::FR); // FR have first read mapping forward
-        val = findFirstMappingKmer(v1);
+        val = first1;
         km = Bifrost::Kmer(s1 + val.second);
         bool strand = (val.first.getData()->isFw() == (km == km.rep())); // k-mer maps to fw strand?
         // might need to optimize this
@@ -1152,14 +1368,14 @@ void ReadProcessor::processBuffer() {
           }          
         }
         if (vtmp.size() < u.size()) {
-          u = vtmp; // copy
+          u.swap(vtmp);
         }
       }
       
       if (!v2.empty()) {
         vtmp.clear();
         bool secondStrand = (mp.opt.strand == ProgramOptions::StrandType::RF);
-        val = findFirstMappingKmer(v2);
+        val = first2;
         km = Bifrost::Kmer(s2 + val.second);
         bool strand = (val.first.getData()->isFw() == (km == km.rep())); // k-mer maps to fw strand?
         // might need to optimize this
@@ -1175,7 +1391,7 @@ void ReadProcessor::processBuffer() {
           }          
         }
         if (vtmp.size() < u.size()) {
-          u = vtmp; // copy
+          u.swap(vtmp);
         }
       }
     }
@@ -1185,16 +1401,26 @@ void ReadProcessor::processBuffer() {
       ec = tc.findEC(u);
 
       if (!mp.opt.umi) {
+        if (ec == -1 && use_registry) {
+          // novel EC, gets an id right away and is counted like the others
+          ec = mp.new_ecs.findOrInsert(u);
+          if (ec >= counts.size()) {
+            counts.resize(ec + 1, 0);
+          }
+        }
         // count the pseudoalignment
-        if (ec == -1 || ec >= counts.size()) {
+        if (!knownEC(ec)) {
           // something we haven't seen before
           newEcs.push_back(u);
         } else {
           // add to count vector
-          ++counts[ec];
+          countEC(ec);
+          if (track_hits) {
+            ec_hits.push_back(ec);
+          }
         }
       } else {       
-        if (ec == -1 || ec >= counts.size()) {
+        if (!knownEC(ec)) {
           new_ec_umi.emplace_back(u, std::move(umis[i]));          
         } else {
           ec_umi.emplace_back(ec, std::move(umis[i]));
@@ -1203,17 +1429,17 @@ void ReadProcessor::processBuffer() {
 
       /* -- collect extra information -- */
       // collect bias info
-      if (findBias && !u.empty() && biasgoal > 0) {
+      if (COLLECT && findBias && !u.empty() && biasgoal > 0) {
         // collect sequence specific bias info
-        if (tc.countBias(s1, (paired) ? s2 : nullptr, v1, v2, paired, bias5)) {
+        if (tc.countBias(s1, (PAIRED) ? s2 : nullptr, v1, v2, PAIRED, bias5)) {
           biasgoal--;
         }
       }
 
       // collect fragment length info
-      if (findFragmentLength && flengoal > 0 && paired && 0 <= ec &&  ec < index.num_trans && !v1.empty() && !v2.empty()) {
+      if (COLLECT && findFragmentLength && flengoal > 0 && PAIRED && 0 <= ec &&  ec < index.num_trans && !v1.empty() && !v2.empty()) {
         // try to map the reads
-        int tl = index.mapPair(s1, l1, s2, l2, ec);
+        int tl = index.mapPair(s1, first1, s2, first2);
         if (0 < tl && tl < flens.size()) {
           flens[tl]++;
           flengoal--;
@@ -1221,26 +1447,26 @@ void ReadProcessor::processBuffer() {
       }
     }
 
+    if (use_dedup) {
+      if (dedup.size() >= mp.opt.dedup) {
+        dedup.clear();
+      }
+      auto &d = dedup[key];
+      d.ec = u.empty() ? -1 : ec;
+      d.u = u;
+    }
+
     // pseudobam
     
-    if (mp.opt.pseudobam) {
+    if (PSEUDOBAM) {
       PseudoAlignmentInfo info;
-      info.id = (paired) ? (i/2) : i; // read id
-      info.paired = paired;
+      info.id = (PAIRED) ? (i/2) : i; // read id
+      info.paired = PAIRED;
       if (!u.empty()) {
         info.r1empty = v1.empty();
         info.r2empty = v2.empty();
-        EcDataPair val;
-
-        if(!info.r1empty) {
-            val = findFirstMappingKmer(v1);
-            info.k1pos = val.second;
-        } else info.k1pos = -1;
-
-        if(!info.r2empty) {
-            val = findFirstMappingKmer(v2);
-            info.k2pos = val.second;
-        } else info.k2pos = -1;
+        info.k1pos = info.r1empty ? -1 : first1.second;
+        info.k2pos = info.r2empty ? -1 : first2.second;
         
         if (ec != -1) {
           info.ec_id = ec;
@@ -1264,28 +1490,78 @@ void ReadProcessor::processBuffer() {
       }
       */
     }
-    
-    if (mp.opt.verbose && numreads > 0 && numreads % 1000000 == 0 ) {   
-      int nmap = mp.nummapped;
-      for (int i = 0; i < counts.size(); i++) {
-        nmap += counts[i];
-      }
-      nmap += newEcs.size();
+  }
 
-      std::cerr << '\r' << (numreads/1000000) << "M reads processed (" 
-        << std::fixed << std::setw( 3 ) << std::setprecision( 1 ) << ((100.0*nmap)/double(numreads))
-        << "% pseudoaligned)"; std::cerr.flush();
+  if (use_dedup) {
+    mp.dedup_lookups += dedup_lookups;
+    mp.dedup_hits += dedup_hits;
+  }
+}
+
+void ReadProcessor::processBuffer() {
+  bool findFragmentLength = (mp.opt.fld == 0) && (mp.tlencount < 10000);
+  if (mp.opt.batch_mode) {
+    findFragmentLength = (mp.opt.fld == 0) && (mp.tlencounts[id] < 10000);
+  }
+
+  int flengoal = 0;
+  flens.clear();
+  if (findFragmentLength) {
+    flengoal = (10000 - mp.tlencount);
+    if (flengoal <= 0) {
+      findFragmentLength = false;
+      flengoal = 0;
+    } else {
+      flens.resize(tc.flens.size(), 0);
     }
   }
 
+  int maxBiasCount = 0;
+  bool findBias = mp.opt.bias && (mp.biasCount < mp.maxBiasCount);
+
+
+  int biasgoal  = 0;
+  bias5.clear();
+  if (findBias) {
+    biasgoal = (mp.maxBiasCount - mp.biasCount);
+    if (biasgoal <= 0) {
+      findBias = false;
+    } else {
+      bias5.resize(tc.bias5.size(),0);
+    }
+  }
+
+  // the per read loop is compiled for each combination of the options
+  // that are checked most often, pick the one for this batch
+  typedef void (ReadProcessor::*Loop)(bool, int, bool, int);
+  static const Loop loops[16] = {
+    &ReadProcessor::processLoop<false, false, false, false>,
+    &ReadProcessor::processLoop<false, false, false, true>,
+    &ReadProcessor::processLoop<false, false, true, false>,
+    &ReadProcessor::processLoop<false, false, true, true>,
+    &ReadProcessor::processLoop<false, true, false, false>,
+    &ReadProcessor::processLoop<false, true, false, true>,
+    &ReadProcessor::processLoop<false, true, true, false>,
+    &ReadProcessor::processLoop<false, true, true, true>,
+    &ReadProcessor::processLoop<true, false, false, false>,
+    &ReadProcessor::processLoop<true, false, false, true>,
+    &ReadProcessor::processLoop<true, false, true, false>,
+    &ReadProcessor::processLoop<true, false, true, true>,
+    &ReadProcessor::processLoop<true, true, false, false>,
+    &ReadProcessor::processLoop<true, true, false, true>,
+    &ReadProcessor::processLoop<true, true, true, false>,
+    &ReadProcessor::processLoop<true, true, true, true>
+  };
+  int variant = (paired ? 8 : 0) | (mp.opt.strand_specific ? 4 : 0)
+    | (mp.opt.pseudobam ? 2 : 0) | ((findBias || findFragmentLength) ? 1 : 0);
+  (this->*loops[variant])(findFragmentLength, flengoal, findBias, biasgoal);
 }
 
 void ReadProcessor::clear() {
   numreads=0;
   memset(buffer,0,bufsize);
   newEcs.clear();
-  counts.clear();
-  counts.resize(tc.counts.size(),0);
+  ec_hits.clear();
   ec_umi.clear();
   new_ec_umi.clear();
 }
@@ -1300,7 +1576,7 @@ BUSProcessor::BUSProcessor(const KmerIndex& index, const ProgramOptions& opt, co
    seqs.reserve(bufsize/50);
    newEcs.reserve(1000);
    bv.reserve(1000);
-   counts.reserve((int) (tc.counts.size() * 1.25));
+   counts.assign(tc.counts.size(), 0); // kept for the whole run
    memset(&bc_len[0],0,33);
    memset(&umi_len[0],0,33);
 
@@ -1345,15 +1621,23 @@ void BUSProcessor::operator()() {
   while (true) {
     int readbatch_id;
     // grab the reader lock
-    {
-      std::lock_guard<std::mutex> lock(mp.reader_lock);
+    if (mp.SR->chunked()) {
+      {
+        auto lock = timedLock(mp.reader_lock, PerfStats::local().reader_wait);
+        if (!mp.SR->claimChunk(chunk, bufsize, readbatch_id)) {
+          break;
+        }
+      }
+      mp.SR->parseChunk(chunk, buffer, seqs, names, quals, flags, mp.store_reads);
+    } else {
+      auto lock = timedLock(mp.reader_lock, PerfStats::local().reader_wait);
       if (mp.SR->empty()) {
         // nothing to do
-        return;
+        break;
       } else {
         // get new sequences
-        std::vector<std::string> umis;
-        mp.SR->fetchSequences(buffer, bufsize, seqs, names, quals, flags, umis, readbatch_id, false);
+        std::vector<uint64_t> umis;
+        mp.SR->fetchSequences(buffer, bufsize, seqs, names, quals, flags, umis, readbatch_id, mp.store_reads);
       }
       // release the reader lock
     }
@@ -1361,24 +1645,33 @@ void BUSProcessor::operator()() {
     
     pseudobatch.aln.clear();
     pseudobatch.batch_id = readbatch_id;
+    pseudobatch.reads.clear();
+    if (mp.store_reads) {
+      packReads(pseudobatch.reads, seqs, names, quals);
+    }
     // process our sequences
     processBuffer();
 
     // update the results, MP acquires the lock
-    std::vector<std::pair<int, std::string>> ec_umi;
-    std::vector<std::pair<std::vector<int>, std::string>> new_ec_umi;
-    mp.update(counts, newEcs, ec_umi, new_ec_umi, seqs.size() / mp.opt.busOptions.nfiles , flens, bias5, pseudobatch, bv, newB, &bc_len[0], &umi_len[0], id, local_id);
+    std::vector<std::pair<int, uint64_t>> ec_umi;
+    std::vector<std::pair<std::vector<int>, uint64_t>> new_ec_umi;
+    mp.update(std::vector<int>{}, newEcs, ec_umi, new_ec_umi, seqs.size() / mp.opt.busOptions.nfiles , flens, bias5, pseudobatch, bv, newB, &bc_len[0], &umi_len[0], id, local_id);
+    if (mp.SR->chunked()) {
+      mp.SR->releaseChunk(chunk);
+    }
     clear();
   }
+  mp.mergeCounts(counts);
 }
 
 void BUSProcessor::processBuffer() {
   // set up thread variables  
   std::vector<EcDataPair> v,v2;
   std::vector<int> vtmp;
-  std::vector<int> u;
+  std::vector<int> u, utmp;
   
   u.reserve(1000);
+  utmp.reserve(1000);
   v.reserve(1000);
   vtmp.reserve(1000);
 
@@ -1485,11 +1778,11 @@ void BUSProcessor::processBuffer() {
     u.clear();
 
     // process 2nd read
-    index.match(seq,seqlen, v);
+    index.match(seq,seqlen, v, true);
 
     // collect the target information
     int ec = -1;
-    int r = tc.intersectKmers(v, v2, false,u);
+    int r = tc.intersectKmers(v, v2, false, u, utmp);
     if (!u.empty()) {      
       ec = tc.findEC(u);
     }
@@ -1567,8 +1860,6 @@ void BUSProcessor::clear() {
   numreads=0;
   memset(buffer,0,bufsize);
   newEcs.clear();
-  counts.clear();  
-  counts.resize(tc.counts.size(),0);
   bv.clear();
   newB.clear();
 }
@@ -1655,17 +1946,39 @@ void AlnProcessor::operator()() {
     int readbatch_id;
     // grab the reader lock
     if (mp.opt.batch_mode) {
-      std::lock_guard<std::mutex> lock(mp.reader_lock);
+      auto lock = timedLock(mp.reader_lock, PerfStats::local().reader_wait);
       if (batchSR.empty()) {
         return;
       } else {
         batchSR.fetchSequences(buffer, bufsize, seqs, names, quals, flags, umis, readbatch_id, true );
         readPseudoAlignmentBatch(mp.pseudobatchf_in, pseudobatch);
-        assert(pseudobatch.batch_id == readbatch_id);
+        // batch ids are numbered across all cells, see next_pseudobatch_id
         assert(pseudobatch.aln.size() == ((paired) ? seqs.size()/2 : seqs.size())); // sanity checks
       }
+    } else if (mp.store_reads) {
+      {
+        auto lock = timedLock(mp.reader_lock, PerfStats::local().reader_wait);
+        if (mp.pseudobatchf_in.peek() == EOF) {
+          return;
+        }
+        readPseudoAlignmentBatch(mp.pseudobatchf_in, pseudobatch);
+      }
+      // the reads were saved along with the pseudoalignments
+      unpackReads(pseudobatch.reads, seqs, names, quals);
+      assert(pseudobatch.aln.size() == ((paired) ? seqs.size()/2 : seqs.size()));
+    } else if (mp.SR->chunked()) {
+      {
+        auto lock = timedLock(mp.reader_lock, PerfStats::local().reader_wait);
+        if (!mp.SR->claimChunk(chunk, bufsize, readbatch_id)) {
+          return;
+        }
+        readPseudoAlignmentBatch(mp.pseudobatchf_in, pseudobatch);
+      }
+      mp.SR->parseChunk(chunk, buffer, seqs, names, quals, flags, true);
+      assert(pseudobatch.batch_id == readbatch_id);
+      assert(pseudobatch.aln.size() == ((paired) ? seqs.size()/2 : seqs.size())); // sanity checks
     } else {
-      std::lock_guard<std::mutex> lock(mp.reader_lock);
+      auto lock = timedLock(mp.reader_lock, PerfStats::local().reader_wait);
       if (mp.SR->empty()) {
         // nothing to do
         return;
@@ -1687,6 +2000,9 @@ void AlnProcessor::operator()() {
       processBufferTrans();
     }
 
+    if (!mp.opt.batch_mode && mp.SR->chunked()) {
+      mp.SR->releaseChunk(chunk);
+    }
 
   }
 }
@@ -2758,9 +3074,7 @@ void SequenceReader::reset() {
 
 FastqSequenceReader::~FastqSequenceReader() {
   for (auto &f : fp) {
-    if (f) {
-      gzclose(f);
-    }
+    delete f;
   }
 
   for (auto &s : seq) {
@@ -2783,9 +3097,7 @@ void FastqSequenceReader::reset() {
   SequenceReader::reset();
    
   for (auto &f : fp) {
-    if (f) {
-      gzclose(f);
-    }
+    delete f;
     f = nullptr;
   }
 
@@ -2816,16 +3128,49 @@ void FastqSequenceReader::reserveNfiles(int n) {
   seq.resize(nfiles, nullptr);
 }
 
+// returns the first word on the next line of the UMI file
+uint64_t FastqSequenceReader::readUMI() {
+  if (umi_buf.empty()) {
+    umi_buf.resize(1 << 16);
+  }
+  while (true) {
+    char *p = umi_buf.data() + umi_pos;
+    char *e = umi_buf.data() + umi_end;
+    char *nl = scanFor(p, e, '\n');
+    bool more = (nl == e) && f_umi->good();
+    if (more) {
+      // move the partial line to the front and read the next chunk
+      size_t rem = e - p;
+      memmove(umi_buf.data(), p, rem);
+      umi_pos = 0;
+      umi_end = rem;
+      if (umi_buf.size() - rem < 1024) {
+        umi_buf.resize(2 * umi_buf.size());
+      }
+      f_umi->read(umi_buf.data() + rem, umi_buf.size() - rem);
+      umi_end += f_umi->gcount();
+      continue;
+    }
+    umi_pos = (nl == e) ? umi_end : (nl - umi_buf.data()) + 1;
+    while (p < nl && isspace(*p)) {
+      ++p;
+    }
+    char *w = p;
+    while (w < nl && !isspace(*w)) {
+      ++w;
+    }
+    return umi_packer.pack(p, w - p);
+  }
+}
+
 // returns true if there is more left to read from the files
 bool FastqSequenceReader::fetchSequences(char *buf, const int limit, std::vector<std::pair<const char *, int> > &seqs,
   std::vector<std::pair<const char *, int> > &names,
   std::vector<std::pair<const char *, int> > &quals,
   std::vector<uint32_t>& flags,
-  std::vector<std::string> &umis, int& read_id,
+  std::vector<uint64_t> &umis, int& read_id,
   bool full) {
     
-  std::string line;
-  std::string umi;
   readbatch_id += 1; // increase the batch id
   read_id = readbatch_id; // copy now because we are inside a lock
   seqs.clear();
@@ -2849,9 +3194,8 @@ bool FastqSequenceReader::fetchSequences(char *buf, const int limit, std::vector
       } else {
         // close the current files
         for (auto &f : fp) {
-          if (f) {
-            gzclose(f);
-          }
+          delete f;
+          f = nullptr;
         }
         // close current umi file
         if (usingUMIfiles) {
@@ -2861,7 +3205,14 @@ bool FastqSequenceReader::fetchSequences(char *buf, const int limit, std::vector
         
         // open the next one
         for (int i = 0; i < nfiles; i++) {
-          fp[i] = gzopen(files[current_file+i].c_str(), "r");
+          fp[i] = InputStream::open(files[current_file+i]);
+          if (fp[i] == nullptr) {
+            std::cerr << "Error: could not open file " << files[current_file+i] << std::endl;
+            exit(1);
+          }
+          if (seq[i] != nullptr) {
+            kseq_destroy(seq[i]);
+          }
           seq[i] = kseq_init(fp[i]);
           l[i] = kseq_read(seq[i]);
           
@@ -2869,6 +3220,7 @@ bool FastqSequenceReader::fetchSequences(char *buf, const int limit, std::vector
         if (usingUMIfiles) {
           // open new umi file
           f_umi->open(umi_files[current_file]);  
+          umi_pos = umi_end = 0;
           current_file++;        
         }
         current_file+=nfiles;
@@ -2913,11 +3265,7 @@ bool FastqSequenceReader::fetchSequences(char *buf, const int limit, std::vector
         }
 
         if (usingUMIfiles) {
-          std::stringstream ss;
-          std::getline(*f_umi, line);
-          ss.str(line);
-          ss >> umi;
-          umis.emplace_back(std::move(umi));
+          umis.push_back(readUMI());
         }
 
         numreads++;
@@ -2949,7 +3297,8 @@ FastqSequenceReader::FastqSequenceReader(FastqSequenceReader&& o) :
   umi_files(std::move(o.umi_files)),
   f_umi(std::move(o.f_umi)),
   current_file(o.current_file),
-  seq(std::move(o.seq)) {
+  seq(std::move(o.seq)),
+  umi_packer(std::move(o.umi_packer)) {
 
   o.fp.resize(nfiles);
   o.l.resize(nfiles, 0);
@@ -2958,7 +3307,399 @@ FastqSequenceReader::FastqSequenceReader(FastqSequenceReader&& o) :
   o.state = false;
 }
 
-const std::string BamSequenceReader::seq_enc = "=ACMGRSVTWYHKDBN";
+// returns the end of the 4-line record starting at p. Returns nullptr if
+// there is no record left, and also sets err if what is left is not a
+// complete record. A missing newline at the end of the file is fine.
+static char* nextFastqRecord(char *p, char *end, const char *&err) {
+  err = nullptr;
+  if (p >= end) {
+    return nullptr;
+  }
+  char *line[4];
+  size_t len[4];
+  for (int i = 0; i < 4; i++) {
+    if (p >= end) {
+      err = "the last record is truncated";
+      return nullptr;
+    }
+    char *nl = scanFor(p, end, '\n');
+    line[i] = p;
+    len[i] = (nl > p && *(nl-1) == '\r') ? nl - p - 1 : nl - p;
+    p = (nl == end) ? end : nl + 1;
+  }
+  if (*line[0] != '@') {
+    err = "expected '@' at the start of a read name";
+    return nullptr;
+  }
+  if (len[2] == 0 || *line[2] != '+' || len[1] != len[3]) {
+    err = "expected the sequence and quality scores on one line each";
+    return nullptr;
+  }
+  return p;
+}
+
+// null terminates the line starting at p in place, returns the start of the
+// next line and sets len to the length of the line without the line break.
+// The byte at end is writable, see claimChunk.
+static char* terminateLine(char *p, char *end, int &len) {
+  char *nl = scanFor(p, end, '\n');
+  char *next = (nl == end) ? end : nl + 1;
+  if (nl > p && *(nl-1) == '\r') {
+    --nl;
+  }
+  len = nl - p;
+  *nl = '\0';
+  return next;
+}
+
+MmapFastqSequenceReader::MmapFastqSequenceReader(const ProgramOptions& opt) : SequenceReader(opt),
+  files(opt.files), current_file(0) {
+  SequenceReader::state = false;
+
+  if (opt.bus_mode) {
+    nfiles = opt.busOptions.nfiles;
+  } else {
+    nfiles = opt.single_end ? 1 : 2;
+  }
+  reserveNfiles(nfiles);
+}
+
+MmapFastqSequenceReader::~MmapFastqSequenceReader() {
+  unmapAll();
+}
+
+// true if every file is a non-empty, regular, uncompressed FASTQ file
+bool MmapFastqSequenceReader::canMap(const std::vector<std::string>& files) {
+  if (files.empty()) {
+    return false;
+  }
+  for (const auto& fn : files) {
+    struct stat stFileInfo;
+    if (stat(fn.c_str(), &stFileInfo) != 0 || !S_ISREG(stFileInfo.st_mode) || stFileInfo.st_size == 0) {
+      return false;
+    }
+    std::ifstream in(fn, std::ios::binary);
+    if (in.peek() != '@') {
+      return false; // gzipped or FASTA
+    }
+    std::string line;
+    for (int i = 0; i < 3; i++) {
+      if (!std::getline(in, line)) {
+        return false;
+      }
+    }
+    if (line.empty() || line[0] != '+') {
+      return false; // not 4-line FASTQ
+    }
+  }
+  return true;
+}
+
+void MmapFastqSequenceReader::unmapAll() {
+  for (auto &m : maps) {
+    munmap(m.first, m.second);
+  }
+  maps.clear();
+}
+
+bool MmapFastqSequenceReader::empty() {
+  return (!state && current_file >= files.size());
+}
+
+void MmapFastqSequenceReader::reset() {
+  SequenceReader::reset();
+  // the mappings carry our null terminators, map the files again
+  unmapAll();
+  current_file = 0;
+}
+
+void MmapFastqSequenceReader::reserveNfiles(int n) {
+  pos.resize(nfiles, nullptr);
+  end.resize(nfiles, nullptr);
+}
+
+bool MmapFastqSequenceReader::claimChunk(SequenceChunk& chunk, const int limit, int &read_id) {
+  chunk.ranges.resize(nfiles);
+  std::vector<char*> next(nfiles, nullptr);
+  while (true) {
+    if (!state) { // map the next set of files
+      if (current_file >= files.size()) {
+        return false;
+      }
+      for (int i = 0; i < nfiles; i++) {
+        const std::string& fn = files[current_file+i];
+        int fd = open(fn.c_str(), O_RDONLY);
+        struct stat stFileInfo;
+        if (fd < 0 || fstat(fd, &stFileInfo) != 0) {
+          std::cerr << "Error: could not open file " << fn << std::endl;
+          exit(1);
+        }
+        size_t size = stFileInfo.st_size;
+        // private writable mapping, our writes never reach the file. It is
+        // placed over one zeroed byte more than the file, which terminates
+        // the last line when the file does not end with a newline
+        void *m = mmap(nullptr, size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m != MAP_FAILED && mmap(m, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+          munmap(m, size + 1);
+          m = MAP_FAILED;
+        }
+        close(fd);
+        if (m == MAP_FAILED) {
+          std::cerr << "Error: could not map file " << fn << std::endl;
+          exit(1);
+        }
+        madvise(m, size, MADV_SEQUENTIAL);
+        maps.emplace_back((char*) m, size + 1);
+        pos[i] = (char*) m;
+        end[i] = (char*) m + size;
+      }
+      current_file += nfiles;
+      state = true;
+    }
+
+    // take records from all files in lockstep until the first file has
+    // contributed its share of the limit
+    uint32_t n = 0;
+    for (int i = 0; i < nfiles; i++) {
+      chunk.ranges[i] = {pos[i], pos[i]};
+    }
+    while (chunk.ranges[0].second - chunk.ranges[0].first < limit / nfiles) {
+      int done = 0;
+      for (int i = 0; i < nfiles; i++) {
+        const char *err;
+        next[i] = nextFastqRecord(chunk.ranges[i].second, end[i], err);
+        if (err != nullptr) {
+          std::cerr << "Error: malformed FASTQ record in " << files[current_file-nfiles+i]
+                    << ", " << err << std::endl;
+          exit(1);
+        }
+        done += (next[i] == nullptr);
+      }
+      if (done == nfiles) {
+        state = false; // done with these files
+        break;
+      }
+      if (done > 0) {
+        int i = 0, j = 0;
+        while (next[i] != nullptr) ++i;
+        while (next[j] == nullptr) ++j;
+        std::cerr << "Error: file " << files[current_file-nfiles+i] << " has fewer reads than "
+                  << files[current_file-nfiles+j] << std::endl;
+        exit(1);
+      }
+      for (int i = 0; i < nfiles; i++) {
+        chunk.ranges[i].second = next[i];
+      }
+      ++n;
+    }
+    for (int i = 0; i < nfiles; i++) {
+      pos[i] = chunk.ranges[i].second;
+    }
+
+    if (n > 0) {
+      readbatch_id += 1;
+      read_id = readbatch_id;
+      chunk.first_read = numreads;
+      numreads += n;
+      return true;
+    }
+  }
+}
+
+void MmapFastqSequenceReader::parseChunk(SequenceChunk& chunk, char *buf, std::vector<std::pair<const char *, int> > &seqs,
+  std::vector<std::pair<const char *, int> > &names,
+  std::vector<std::pair<const char *, int> > &quals,
+  std::vector<uint32_t>& flags,
+  bool full) {
+
+  // the pages of the chunk are read in here, count it as input
+  PerfTimer timer;
+  seqs.clear();
+  if (full) {
+    names.clear();
+    quals.clear();
+  }
+  flags.clear();
+
+  uint32_t numread = chunk.first_read;
+  std::vector<char*> p(nfiles);
+  for (int i = 0; i < nfiles; i++) {
+    p[i] = chunk.ranges[i].first;
+  }
+  while (p[0] < chunk.ranges[0].second) {
+    for (int i = 0; i < nfiles; i++) {
+      char *e = chunk.ranges[i].second;
+      char *name = p[i] + 1; // claimChunk checked the record
+      char *s = scanFor(name, e, '\n') + 1;
+      int nlen = 0;
+      while (name + nlen < s - 1 && !isspace(name[nlen])) {
+        ++nlen;
+      }
+      int slen, plen, qlen;
+      char *plus = terminateLine(s, e, slen);
+      char *q = terminateLine(plus, e, plen);
+      p[i] = terminateLine(q, e, qlen);
+      name[nlen] = '\0';
+
+      seqs.emplace_back(s, slen);
+      if (full) {
+        quals.emplace_back(q, qlen);
+        names.emplace_back(name, nlen);
+      }
+    }
+    ++numread;
+    flags.push_back(numread);
+  }
+
+  PerfCounters& perf = PerfStats::local();
+  perf.input_seconds += timer.seconds();
+  for (auto &r : chunk.ranges) {
+    perf.bytes_read += r.second - r.first;
+  }
+}
+
+// hand the pages of a processed chunk back, discarding our private copies
+void MmapFastqSequenceReader::releaseChunk(SequenceChunk& chunk) {
+  const uintptr_t pagesize = sysconf(_SC_PAGESIZE);
+  for (auto &r : chunk.ranges) {
+    // pages shared with neighbouring chunks may still be in use
+    uintptr_t b = ((uintptr_t) r.first + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t e = ((uintptr_t) r.second) & ~(pagesize - 1);
+    if (b < e) {
+      madvise((void*) b, e - b, MADV_DONTNEED);
+    }
+  }
+  chunk.ranges.clear();
+}
+
+// returns true if there is more left to read from the files
+bool MmapFastqSequenceReader::fetchSequences(char *buf, const int limit, std::vector<std::pair<const char *, int> > &seqs,
+  std::vector<std::pair<const char *, int> > &names,
+  std::vector<std::pair<const char *, int> > &quals,
+  std::vector<uint32_t>& flags,
+  std::vector<uint64_t> &umis, int& read_id,
+  bool full) {
+
+  SequenceChunk chunk;
+  umis.clear();
+  if (!claimChunk(chunk, limit, read_id)) {
+    seqs.clear();
+    flags.clear();
+    return false;
+  }
+  parseChunk(chunk, buf, seqs, names, quals, flags, full);
+  return !empty();
+}
+
+CacheSequenceReader::CacheSequenceReader(const ProgramOptions& opt) : SequenceReader(opt),
+  next_block(0) {
+  if (!readReadCacheInfo(opt.files[0], info)) {
+    std::cerr << "Error: could not read the block index of read cache " << opt.files[0] << std::endl;
+    exit(1);
+  }
+  fd = open(opt.files[0].c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Error: could not open read cache " << opt.files[0] << std::endl;
+    exit(1);
+  }
+  SequenceReader::state = !info.blocks.empty();
+}
+
+CacheSequenceReader::~CacheSequenceReader() {
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+bool CacheSequenceReader::empty() {
+  return next_block >= info.blocks.size();
+}
+
+void CacheSequenceReader::reset() {
+  SequenceReader::reset();
+  next_block = 0;
+  state = !info.blocks.empty();
+}
+
+void CacheSequenceReader::reserveNfiles(int n) {
+}
+
+bool CacheSequenceReader::claimChunk(SequenceChunk& chunk, const int limit, int &read_id) {
+  if (next_block >= info.blocks.size()) {
+    state = false;
+    return false;
+  }
+  chunk.block = next_block++;
+  chunk.limit = limit;
+  chunk.first_read = info.blocks[chunk.block].first_read;
+  readbatch_id += 1;
+  read_id = readbatch_id;
+  return true;
+}
+
+void CacheSequenceReader::parseChunk(SequenceChunk& chunk, char *buf, std::vector<std::pair<const char *, int> > &seqs,
+  std::vector<std::pair<const char *, int> > &names,
+  std::vector<std::pair<const char *, int> > &quals,
+  std::vector<uint32_t>& flags,
+  bool full) {
+
+  const ReadCacheBlock& b = info.blocks[chunk.block];
+  chunk.data.resize(b.size);
+  size_t done = 0;
+  while (done < b.size) {
+    ssize_t r = pread(fd, &chunk.data[done], b.size - done, b.offset + done);
+    if (r <= 0) {
+      std::cerr << "Error: could not read block " << chunk.block << " of the read cache" << std::endl;
+      exit(1);
+    }
+    done += r;
+  }
+  decodeReadCacheBlock(info, chunk.data, buf, chunk.limit, seqs, names, quals, full);
+
+  flags.clear();
+  uint32_t nfrags = seqs.size() / info.nfiles;
+  for (uint32_t i = 1; i <= nfrags; i++) {
+    flags.push_back(chunk.first_read + i);
+  }
+}
+
+// returns true if there is more left to read from the files
+bool CacheSequenceReader::fetchSequences(char *buf, const int limit, std::vector<std::pair<const char *, int> > &seqs,
+  std::vector<std::pair<const char *, int> > &names,
+  std::vector<std::pair<const char *, int> > &quals,
+  std::vector<uint32_t>& flags,
+  std::vector<uint64_t> &umis, int& read_id,
+  bool full) {
+
+  umis.clear();
+  if (!claimChunk(fetch_chunk, limit, read_id)) {
+    seqs.clear();
+    flags.clear();
+    return false;
+  }
+  parseChunk(fetch_chunk, buf, seqs, names, quals, flags, full);
+  return !empty();
+}
+
+// two bases per byte of 4-bit encoded sequence
+static const std::vector<uint16_t> bamSeqTable = []() {
+  const char *enc = "=ACMGRSVTWYHKDBN";
+  std::vector<uint16_t> t(256);
+  for (int i = 0; i < 256; i++) {
+    char c[2] = {enc[i >> 4], enc[i & 0x0F]};
+    memcpy(&t[i], c, 2);
+  }
+  return t;
+}();
+
+// writes the string value of the tag to p, returns its length
+static int copyBamTag(const bam1_t *b, const char *tag, char *p) {
+  uint8_t *aux = bam_aux_get(b, tag);
+  const char *val = (aux == nullptr) ? "" : bam_aux2Z(aux);
+  int len = strlen(val);
+  memcpy(p, val, len);
+  return len;
+}
 
 BamSequenceReader::~BamSequenceReader() {
   if (fp) {
@@ -2967,9 +3708,6 @@ BamSequenceReader::~BamSequenceReader() {
   if (head) {
     bam_hdr_destroy(head);
   }
-  if (rec) {
-    bam_destroy1(rec);
-  }
 }
 
 bool BamSequenceReader::empty() {
@@ -2983,81 +3721,103 @@ void BamSequenceReader::reset() {
 void BamSequenceReader::reserveNfiles(int n) {
 }
 
-// returns true if there is more left to read from the files
-bool BamSequenceReader::fetchSequences(char *buf, const int limit, std::vector<std::pair<const char *, int> > &seqs,
+bool BamSequenceReader::claimChunk(SequenceChunk& chunk, const int limit, int &read_id) {
+  // decoded records never take more space than the raw record plus its
+  // sequence, stop at half the limit so the last record still fits
+  int bytes = 0;
+  chunk.nrecords = 0;
+  while (state && bytes < limit / 2) {
+    if (chunk.nrecords == chunk.records.size()) {
+      chunk.records.push_back(bam_init1());
+    }
+    bam1_t *b = chunk.records[chunk.nrecords];
+    if (bam_read1(fp, b) < 0) {
+      state = false;
+      break;
+    }
+    if (b->core.flag & BAM_FSECONDARY) {
+      continue; // only primary alignments
+    }
+    bytes += b->l_data + b->core.l_qseq + 4;
+    ++chunk.nrecords;
+  }
+  if (chunk.nrecords == 0) {
+    return false;
+  }
+  readbatch_id += 1;
+  read_id = readbatch_id;
+  return true;
+}
+
+void BamSequenceReader::parseChunk(SequenceChunk& chunk, char *buf, std::vector<std::pair<const char *, int> > &seqs,
   std::vector<std::pair<const char *, int> > &names,
   std::vector<std::pair<const char *, int> > &quals,
   std::vector<uint32_t>& flags,
-  std::vector<std::string> &umis, int& read_id,
   bool full) {
-  
-  readbatch_id += 1; // increase the batch id
-  read_id = readbatch_id; // copy now because we are inside a lock
+
   seqs.clear();
+  if (full) {
+    names.clear();
+    quals.clear();
+  }
   flags.clear();
-  
-  int bufpos = 0;
-  while (true) {
-    if (!state) { // should we open a file
-        return false;
-    }
-
-    // the file is open and we have read into seq1 and seq2
-    if (err >= 0) {
-      if (!(rec->core.flag & BAM_FSECONDARY)) { // record is primary alignment
-        int bufadd = l_seq + l_bc + l_umi + 2;
-        // fits into the buffer
-        if (bufpos+bufadd < limit) {
-          char *pi;
-
-          pi = buf + bufpos;
-          memcpy(pi, bc, l_bc);
-          memcpy(pi + l_bc, umi, l_umi + 1);
-          seqs.emplace_back(pi, l_bc + l_umi);
-          bufpos += l_bc + l_umi + 1;
-
-          pi = buf + bufpos;
-          int len = (l_seq + 1) / 2;
-          if (l_seq % 2) --len;
-          int j = 0;
-          for (int i = 0; i < len; ++i, ++eseq) {
-            buf[bufpos++] = seq_enc[*eseq >> 4];
-            buf[bufpos++] = seq_enc[*eseq & 0x0F];
-          }
-          if (l_seq % 2) {
-            buf[bufpos++] = seq_enc[*eseq >> 4];
-          }
-          buf[bufpos++] = '\0';
-          seqs.emplace_back(pi, l_seq);
-
-        } else {
-          return true; // read it next time
-        }
-      }
-      
-      // read for the next one
-      err = bam_read1(fp, rec);
-      if (err < 0) {
-        return true;
-      }
-      eseq = bam_get_seq(rec);
-      l_seq = rec->core.l_qseq;
 
-      bc = bam_aux2Z(bam_aux_get(rec, "CR"));
-      l_bc = 0;
-      for (char *pbc = bc; *pbc != '\0'; ++pbc) {
-        ++l_bc;
-      }
-
-      umi = bam_aux2Z(bam_aux_get(rec, "UR"));
-      l_umi = 0;
-      for (char *pumi = umi; *pumi != '\0'; ++pumi) {
-        ++l_umi;
-      }
-
-    } else {
-      state = false; // haven't opened file yet
+  char *p = buf;
+  for (size_t r = 0; r < chunk.nrecords; r++) {
+    const bam1_t *b = chunk.records[r];
+
+    // barcode followed by umi
+    char *pi = p;
+    int len = copyBamTag(b, "CR", p);
+    len += copyBamTag(b, "UR", p + len);
+    p[len] = '\0';
+    seqs.emplace_back(pi, len);
+    p += len + 1;
+
+    int l_seq = b->core.l_qseq;
+    const uint8_t *eseq = bam_get_seq(b);
+    pi = p;
+    for (int i = 0; i < l_seq / 2; i++) {
+      memcpy(p, &bamSeqTable[eseq[i]], 2);
+      p += 2;
+    }
+    if (l_seq % 2) {
+      *p++ = ((const char*) &bamSeqTable[eseq[l_seq / 2]])[0];
+    }
+    *p++ = '\0';
+    seqs.emplace_back(pi, l_seq);
+
+    if (full) {
+      const char *name = bam_get_qname(b);
+      int nlen = b->core.l_qname - b->core.l_extranul - 1;
+      names.emplace_back(name, nlen);
+      names.emplace_back(name, nlen);
+      quals.emplace_back(p, 0);
+      *p++ = '\0';
+      const uint8_t *q = bam_get_qual(b);
+      pi = p;
+      for (int i = 0; i < l_seq; i++) {
+        *p++ = (q[0] == 0xff) ? 'I' : (char) (q[i] + 33); // 0xff: no qualities stored
+      }
+      *p++ = '\0';
+      quals.emplace_back(pi, l_seq);
     }
   }
 }
 
+// returns true if there is more left to read from the files
+bool BamSequenceReader::fetchSequences(char *buf, const int limit, std::vector<std::pair<const char *, int> > &seqs,
+  std::vector<std::pair<const char *, int> > &names,
+  std::vector<std::pair<const char *, int> > &quals,
+  std::vector<uint32_t>& flags,
+  std::vector<uint64_t> &umis, int& read_id,
+  bool full) {
+
+  if (!claimChunk(fetch_chunk, limit, read_id)) {
+    seqs.clear();
+    flags.clear();
+    return false;
+  }
+  parseChunk(fetch_chunk, buf, seqs, names, quals, flags, full);
+  return state;
+}
@@ -23,12 +23,18 @@
 #include "GeneModel.h"
 #include "BUSData.h"
 #include "BUSTools.h"
+#include "ReadCache.h"
+#include "ReadAhead.h"
+#include "EcRegistry.h"
+#include "ThreadPool.h"
+#include "PerfStats.h"
+#include "SparseCounts.h"
 #include <htslib/sam.h>
 
 
 #ifndef KSEQ_INIT_READY
 #define KSEQ_INIT_READY
-KSEQ_INIT(gzFile, gzread)
+KSEQ_INIT(InputStream*, readInputStream)
 #endif
 
 class MasterProcessor;
@@ -37,6 +43,28 @@ int64_t ProcessReads(MasterProcessor& MP, const  ProgramOptions& opt);
 int64_t ProcessBatchReads(MasterProcessor& MP, const ProgramOptions& opt);
 int64_t ProcessBUSReads(MasterProcessor& MP, const ProgramOptions& opt);
 EcDataPair findFirstMappingKmer(const std::vector<EcDataPair> &v);
+bool seekableInput(const std::vector<std::string>& files);
+
+// A run of whole records claimed from a reader while holding the reader lock,
+// parsed afterwards by the claiming thread without the lock.
+struct SequenceChunk {
+  std::vector<std::pair<char*, char*>> ranges; // [begin, end) for each input file
+  std::vector<bam1_t*> records; // raw BAM records, reused between chunks
+  size_t nrecords = 0;
+  std::string data; // raw read cache block
+  size_t block = 0;
+  size_t limit = 0; // size of the buffer given to parseChunk
+  uint32_t first_read = 0; // number of reads preceding this chunk
+
+  SequenceChunk() {}
+  SequenceChunk(const SequenceChunk&) = delete;
+  SequenceChunk& operator=(const SequenceChunk&) = delete;
+  ~SequenceChunk() {
+    for (auto b : records) {
+      bam_destroy1(b);
+    }
+  }
+};
 
 class SequenceReader {
 public:
@@ -54,9 +82,19 @@ public:
                       std::vector<std::pair<const char*, int>>& names,
                       std::vector<std::pair<const char*, int>>& quals,
                       std::vector<uint32_t>& flags,
-                      std::vector<std::string>& umis, int &readbatch_id,
+                      std::vector<uint64_t>& umis, int &readbatch_id,
                       bool full=false) = 0;
 
+  // chunked readers only claim records under the reader lock, the records
+  // are parsed into seqs by the claiming thread, using buf if needed
+  virtual bool chunked() const { return false; }
+  virtual bool claimChunk(SequenceChunk& chunk, const int limit, int &readbatch_id) { return false; }
+  virtual void parseChunk(SequenceChunk& chunk, char *buf, std::vector<std::pair<const char*, int>>& seqs,
+                      std::vector<std::pair<const char*, int>>& names,
+                      std::vector<std::pair<const char*, int>>& quals,
+                      std::vector<uint32_t>& flags,
+                      bool full=false) {}
+  virtual void releaseChunk(SequenceChunk& chunk) {}
 
 public:
   bool state; // is the file open
@@ -92,13 +130,13 @@ public:
                       std::vector<std::pair<const char*, int>>& names,
                       std::vector<std::pair<const char*, int>>& quals,
                       std::vector<uint32_t>& flags,
-                      std::vector<std::string>& umis, int &readbatch_id,
+                      std::vector<uint64_t>& umis, int &readbatch_id,
                       bool full=false);
 
 public:
   int nfiles = 1;
   uint32_t numreads = 0;
-  std::vector<gzFile> fp;
+  std::vector<InputStream*> fp;
   std::vector<int> l;
   std::vector<int> nl;
   bool paired;
@@ -107,6 +145,90 @@ public:
   std::unique_ptr<std::ifstream> f_umi;
   int current_file;
   std::vector<kseq_t*> seq;
+
+  // the UMI file is read in bulk, one UMI per line
+  std::vector<char> umi_buf;
+  size_t umi_pos = 0;
+  size_t umi_end = 0;
+  uint64_t readUMI();
+  UMIPacker umi_packer;
+};
+
+// Reads uncompressed 4-line FASTQ files through a private memory mapping.
+// Records are handed out as views into the mapping, the newlines following
+// the name, sequence and quality strings are overwritten in place so that
+// the views are null terminated like the ones kseq produces.
+class MmapFastqSequenceReader : public SequenceReader {
+public:
+
+  MmapFastqSequenceReader(const ProgramOptions& opt);
+  ~MmapFastqSequenceReader();
+
+  static bool canMap(const std::vector<std::string>& files);
+
+  bool empty();
+  void reset();
+  void reserveNfiles(int n);
+  bool fetchSequences(char *buf, const int limit, std::vector<std::pair<const char*, int>>& seqs,
+                      std::vector<std::pair<const char*, int>>& names,
+                      std::vector<std::pair<const char*, int>>& quals,
+                      std::vector<uint32_t>& flags,
+                      std::vector<uint64_t>& umis, int &readbatch_id,
+                      bool full=false);
+
+  bool chunked() const { return true; }
+  bool claimChunk(SequenceChunk& chunk, const int limit, int &readbatch_id);
+  void parseChunk(SequenceChunk& chunk, char *buf, std::vector<std::pair<const char*, int>>& seqs,
+                      std::vector<std::pair<const char*, int>>& names,
+                      std::vector<std::pair<const char*, int>>& quals,
+                      std::vector<uint32_t>& flags,
+                      bool full=false);
+  void releaseChunk(SequenceChunk& chunk);
+
+public:
+  int nfiles = 1;
+  uint32_t numreads = 0;
+  std::vector<std::string> files;
+  int current_file;
+  std::vector<std::pair<char*, size_t>> maps; // every mapping made since the last reset
+  std::vector<char*> pos; // next unclaimed record in each file
+  std::vector<char*> end;
+
+private:
+  void unmapAll();
+};
+
+// Reads a read cache written by `kallisto cache`. Only the block number is
+// claimed under the reader lock, reading and decoding happen outside of it.
+class CacheSequenceReader : public SequenceReader {
+public:
+
+  CacheSequenceReader(const ProgramOptions& opt);
+  ~CacheSequenceReader();
+
+  bool empty();
+  void reset();
+  void reserveNfiles(int n);
+  bool fetchSequences(char *buf, const int limit, std::vector<std::pair<const char*, int>>& seqs,
+                      std::vector<std::pair<const char*, int>>& names,
+                      std::vector<std::pair<const char*, int>>& quals,
+                      std::vector<uint32_t>& flags,
+                      std::vector<uint64_t>& umis, int &readbatch_id,
+                      bool full=false);
+
+  bool chunked() const { return true; }
+  bool claimChunk(SequenceChunk& chunk, const int limit, int &readbatch_id);
+  void parseChunk(SequenceChunk& chunk, char *buf, std::vector<std::pair<const char*, int>>& seqs,
+                      std::vector<std::pair<const char*, int>>& names,
+                      std::vector<std::pair<const char*, int>>& quals,
+                      std::vector<uint32_t>& flags,
+                      bool full=false);
+
+public:
+  int fd;
+  ReadCacheInfo info;
+  size_t next_block;
+  SequenceChunk fetch_chunk; // used by fetchSequences
 };
 
 class BamSequenceReader : public SequenceReader {
@@ -117,27 +239,12 @@ public:
     SequenceReader::state = true;
 
     fp = bgzf_open(opt.files[0].c_str(), "rb");
-    head = bam_hdr_read(fp);
-    rec = bam_init1();
-    
-    err = bam_read1(fp, rec);
-    eseq = bam_get_seq(rec);
-    l_seq = rec->core.l_qseq;
-
-    bc = bam_aux2Z(bam_aux_get(rec, "CR"));
-    l_bc = 0;
-    for (char *pbc = bc; *pbc != '\0'; ++pbc) {
-      ++l_bc;
-    }
-
-    umi = bam_aux2Z(bam_aux_get(rec, "UR"));
-    l_umi = 0;
-    for (char *pumi = umi; *pumi != '\0'; ++pumi) {
-      ++l_umi;
+    if (opt.threads > 1) {
+      bgzf_mt(fp, opt.threads, 256); // decompress blocks in parallel
     }
+    head = bam_hdr_read(fp);
   }
-  BamSequenceReader() : SequenceReader() {};
-  BamSequenceReader(BamSequenceReader &&o);
+  BamSequenceReader() : SequenceReader(), fp(nullptr), head(nullptr) {};
   ~BamSequenceReader();
   
   bool empty();
@@ -147,33 +254,51 @@ public:
                       std::vector<std::pair<const char*, int>>& names,
                       std::vector<std::pair<const char*, int>>& quals,
                       std::vector<uint32_t>& flags,
-                      std::vector<std::string>& umis, int &readbatch_id,
+                      std::vector<uint64_t>& umis, int &readbatch_id,
+                      bool full=false);
+
+  bool chunked() const { return true; }
+  bool claimChunk(SequenceChunk& chunk, const int limit, int &readbatch_id);
+  void parseChunk(SequenceChunk& chunk, char *buf, std::vector<std::pair<const char*, int>>& seqs,
+                      std::vector<std::pair<const char*, int>>& names,
+                      std::vector<std::pair<const char*, int>>& quals,
+                      std::vector<uint32_t>& flags,
                       bool full=false);
 
 public:
   BGZF *fp;
   bam_hdr_t *head;
-  bam1_t *rec;
-  uint8_t *eseq;
-  int32_t l_seq;
-  char *bc;
-  int l_bc;
-  char *umi;
-  int l_umi;
-  int err;
-  
-  
-private:
-  static const std::string seq_enc;
+  SequenceChunk fetch_chunk; // used by fetchSequences
+};
+
+// A cell of a batch run. Workers start the cells in order and once there
+// are none left to start they join the cells still being read, so a deep
+// cell doesn't leave the other threads idle.
+struct BatchCell {
+  BatchCell() : active(0), exhausted(false) {}
+
+  std::mutex lock; // guards the members below
+  std::unique_ptr<FastqSequenceReader> SR; // dropped once read to the end
+  int active; // processors reading the cell
+  bool exhausted;
+  SparseCounts counts; // counts of known ECs from the processors that are done
 };
 
 class MasterProcessor {
 public:
   MasterProcessor (KmerIndex &index, const ProgramOptions& opt, MinCollector &tc, const Transcriptome& model)
     : tc(tc), index(index), model(model), bamfp(nullptr), bamfps(nullptr), bamh(nullptr), opt(opt), numreads(0)
-    ,nummapped(0), num_umi(0), bufsize(1ULL<<23), tlencount(0), biasCount(0), maxBiasCount((opt.bias) ? 1000000 : 0), last_pseudobatch_id (-1) { 
+    ,nummapped(0), num_umi(0), bufsize(1ULL<<23), tlencount(0), biasCount(0), maxBiasCount((opt.bias) ? 1000000 : 0)
+    ,new_ecs(tc.counts.size())
+    ,store_reads(opt.pseudobam && !opt.batch_mode && !seekableInput(opt.files)), next_pseudobatch_id(0)
+    ,saturated(false), next_saturation_check(saturationInterval)
+    ,dedup_lookups(0), dedup_hits(0) { 
       if (opt.bam) {
         SR = new BamSequenceReader(opt);
+      } else if (!opt.batch_mode && opt.files.size() == 1 && isReadCache(opt.files[0])) {
+        SR = new CacheSequenceReader(opt);
+      } else if (!opt.batch_mode && MmapFastqSequenceReader::canMap(opt.files)) {
+        SR = new MmapFastqSequenceReader(opt);
       } else {
         SR = new FastqSequenceReader(opt);
       }
@@ -190,6 +315,18 @@ public:
         newBatchECcount.resize(opt.batch_ids.size());
         newBatchECumis.resize(opt.batch_ids.size());
         batchUmis.resize(opt.batch_ids.size());
+        for (int id = 0; id < opt.batch_ids.size(); id++) {
+          batchCells.emplace_back(new BatchCell());
+          batchCells.back()->SR.reset(new FastqSequenceReader());
+          auto &bSR = *batchCells.back()->SR;
+          bSR.files = opt.batch_files[id];
+          bSR.nfiles = opt.batch_files[id].size();
+          bSR.reserveNfiles(opt.batch_files[id].size());
+          if (opt.umi) {
+            bSR.umi_files = {opt.umi_files[id]};
+          }
+          bSR.paired = !opt.single_end;
+        }
       }
       if (opt.fusion) {
         ofusion.open(opt.output + "/fusion.txt");
@@ -197,6 +334,7 @@ public:
       }
       if (opt.pseudobam) {
         pseudobatchf_out.open(opt.output + "/pseudoaln.bin", std::ios::out | std::ios::binary);
+        pseudobatch_writer.reset(new PseudoBatchWriter(pseudobatchf_out));
       }
       if (opt.bus_mode) {
         busf_out.open(opt.output + "/output.bus", std::ios::out | std::ios::binary);
@@ -253,9 +391,13 @@ public:
   std::atomic<int> biasCount;
   std::vector<std::vector<int>> batchFlens;
   std::vector<std::vector<std::pair<int32_t, int32_t>>> batchCounts;
-  std::vector<std::vector<int32_t>> tmp_bc;
+  std::vector<std::unique_ptr<BatchCell>> batchCells;
+  // false if the cell has been read to the end already
+  bool joinBatchCell(int id);
+  // called by the last processor to leave a cell
+  void finishBatchCell(int id);
   const int maxBiasCount;
-  std::unordered_map<std::vector<int>, int, SortedVectorHasher> newECcount;
+  EcRegistry new_ecs; // ECs found by quant, added to the index after processing
   //  std::vector<std::pair<BUSData, std::vector<int32_t>>> newB;  
   EcMap bus_ecmap;
   std::unordered_map<std::vector<int>, int, SortedVectorHasher> bus_ecmapinv;
@@ -265,18 +407,36 @@ public:
   std::ofstream pseudobatchf_out;
   std::ofstream busf_out;
   std::ifstream pseudobatchf_in;
-  std::vector<PseudoAlignmentBatch> pseudobatch_stragglers;
-  int last_pseudobatch_id;
+  std::unique_ptr<PseudoBatchWriter> pseudobatch_writer;
+  const bool store_reads; // reads go into pseudoaln.bin since the input can't be reread
+  std::atomic<int> next_pseudobatch_id; // batch ids of every cell in batch mode, each cell's reader starts at 0
+  // early stopping once the EC proportions no longer change, see checkSaturation
+  static const int64_t saturationInterval = 1000000;
+  std::atomic<bool> saturated;
+  int64_t next_saturation_check;
+  std::vector<int> saturation_counts;
+  int64_t saturation_total = 0;
+  std::vector<int> saturation_snapshot; // the counts at the last check
+  int64_t saturation_snapshot_total = 0;
+  void checkSaturation();
+  std::atomic<int64_t> dedup_lookups;
+  std::atomic<int64_t> dedup_hits;
   void outputFusion(const std::stringstream &o);
   std::vector<std::unordered_map<std::vector<int>, int, SortedVectorHasher>> newBatchECcount;
-  std::vector<std::vector<std::pair<int, std::string>>> batchUmis;
-  std::vector<std::vector<std::pair<std::vector<int>, std::string>>> newBatchECumis;
+  std::vector<std::vector<std::pair<int, uint64_t>>> batchUmis;
+  std::vector<std::vector<std::pair<std::vector<int>, uint64_t>>> newBatchECumis;
   void processReads();
   void processAln(const EMAlgorithm& em, bool useEM);
   void writePseudoBam(const std::vector<bam1_t> &bv);
   void writeSortedPseudobam(const std::vector<std::vector<bam1_t>> &bvv);
   std::vector<uint64_t> breakpoints;
-  void update(const std::vector<int>& c, const std::vector<std::vector<int>>& newEcs, std::vector<std::pair<int, std::string>>& ec_umi, std::vector<std::pair<std::vector<int>, std::string>> &new_ec_umi, int n, std::vector<int>& flens, std::vector<int> &bias, const PseudoAlignmentBatch& pseudobatch, std::vector<BUSData> &bv, std::vector<std::pair<BUSData, std::vector<int32_t>>> newB, int *bc_len, int *umi_len,   int id = -1, int local_id = -1);  
+  // workers keep their counts of known ECs until they finish and hand them
+  // over with mergeCounts, c in update only lists the ECs a batch hit while
+  // saturation is tracked
+  void mergeCounts(const std::vector<int>& c);
+  // in batch mode the counts go to cell id, the processor leaves the cell
+  void mergeCounts(SparseCounts& c, int id);
+  void update(const std::vector<int>& c, const std::vector<std::vector<int>>& newEcs, std::vector<std::pair<int, uint64_t>>& ec_umi, std::vector<std::pair<std::vector<int>, uint64_t>> &new_ec_umi, int n, std::vector<int>& flens, std::vector<int> &bias, PseudoAlignmentBatch& pseudobatch, std::vector<BUSData> &bv, std::vector<std::pair<BUSData, std::vector<int32_t>>> newB, int *bc_len, int *umi_len,   int id = -1, int local_id = -1);  
 };
 
 class ReadProcessor {
@@ -289,11 +449,10 @@ public:
   size_t bufsize;
   bool paired;
   const MinCollector& tc;
-  std::vector<std::pair<int, std::string>> ec_umi;
-  std::vector<std::pair<std::vector<int>, std::string>> new_ec_umi;
+  std::vector<std::pair<int, uint64_t>> ec_umi;
+  std::vector<std::pair<std::vector<int>, uint64_t>> new_ec_umi;
   const KmerIndex& index;
   MasterProcessor& mp;
-  FastqSequenceReader batchSR;
   int64_t numreads;
   int id;
   int local_id;
@@ -304,15 +463,46 @@ public:
   std::vector<std::pair<const char*, int>> names;
   std::vector<std::pair<const char*, int>> quals;
   std::vector<uint32_t> flags;
-  std::vector<std::string> umis;
+  std::vector<uint64_t> umis;
   std::vector<std::vector<int>> newEcs;
   std::vector<int> flens;
   std::vector<int> bias5;
 
+  // counts of known ECs, over all of them for a run over one set of files.
+  // a cell in batch mode sees few of them so they are kept sparse
   std::vector<int> counts;
+  SparseCounts cell_counts;
+  std::vector<int> ec_hits;
+  SequenceChunk chunk;
+
+  bool knownEC(int ec) const {
+    return ec != -1 && ec < (mp.opt.batch_mode ? (int) tc.counts.size() : (int) counts.size());
+  }
+  void countEC(int ec) {
+    if (mp.opt.batch_mode) {
+      cell_counts.add(ec);
+    } else {
+      ++counts[ec];
+    }
+  }
+
+  // per read scratch space, reused for every read in every batch
+  std::vector<EcDataPair> v1, v2;
+  std::vector<int> u, utmp, vtmp;
+
+  // pseudoalignments of recently seen read sequences, keyed by the sequence
+  // (both mates separated by a newline), cleared once it holds opt.dedup entries
+  struct DedupEntry {
+    int ec;
+    std::vector<int> u;
+  };
+  std::unordered_map<std::string, DedupEntry> dedup;
 
   void operator()();
   void processBuffer();
+  // the read loop, specialized on the options that are checked for every read
+  template <bool PAIRED, bool STRANDED, bool PSEUDOBAM, bool COLLECT>
+  void processLoop(bool findFragmentLength, int flengoal, bool findBias, int biasgoal);
   void clear();
 };
 
@@ -351,6 +541,7 @@ public:
   std::vector<int> counts;
   std::vector<BUSData> bv;
   std::vector<std::pair<BUSData, std::vector<int32_t>>> newB;
+  SequenceChunk chunk;
 
   void operator()();
   void processBuffer();
@@ -368,7 +559,7 @@ public:
   size_t bufsize;
   size_t bambufsize;
   bool paired;
-  std::vector<std::pair<int, std::string>> ec_umi;
+  std::vector<std::pair<int, uint64_t>> ec_umi;
   const KmerIndex& index;
   const EMAlgorithm& em;
   MasterProcessor& mp;
@@ -385,7 +576,8 @@ public:
   std::vector<std::pair<const char*, int>> names;
   std::vector<std::pair<const char*, int>> quals;
   std::vector<uint32_t> flags;
-  std::vector<std::string> umis;
+  std::vector<uint64_t> umis;
+  SequenceChunk chunk;
 
   void operator()();
   void processBufferTrans();
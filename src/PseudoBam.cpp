@@ -412,6 +412,9 @@ void writePseudoAlignmentBatch(std::ofstream& of, const PseudoAlignmentBatch& ba
     }
     of.put(0); // mark the end of record
   }
+  uint32_t rsz = batch.reads.size();
+  of.write((char*)&rsz, sizeof(uint32_t));
+  of.write(batch.reads.c_str(), rsz);
 }
 
 
@@ -456,6 +459,72 @@ void readPseudoAlignmentBatch(std::ifstream& in, PseudoAlignmentBatch& batch) {
     assert(mark0 == '\0');
     batch.aln.push_back(std::move(info));
   }
+  uint32_t rsz;
+  in.read((char*)&rsz, sizeof(uint32_t));
+  batch.reads.resize(rsz);
+  in.read(&batch.reads[0], rsz);
   
 }
 
+
+PseudoBatchWriter::PseudoBatchWriter(std::ofstream& out) : out(out), next_id(0), done(false) {
+  writer = std::thread(&PseudoBatchWriter::run, this);
+}
+
+PseudoBatchWriter::~PseudoBatchWriter() {
+  finish();
+}
+
+void PseudoBatchWriter::push(PseudoAlignmentBatch&& batch) {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    incoming.push_back(std::move(batch));
+  }
+  cv.notify_one();
+}
+
+void PseudoBatchWriter::finish() {
+  if (!writer.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m);
+    done = true;
+  }
+  cv.notify_one();
+  writer.join();
+}
+
+void PseudoBatchWriter::run() {
+  std::vector<PseudoAlignmentBatch> batches;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(m);
+      cv.wait(lock, [this]() { return done || !incoming.empty(); });
+      if (incoming.empty()) {
+        break; // done and nothing left
+      }
+      batches.swap(incoming);
+    }
+    for (auto &b : batches) {
+      if (b.batch_id < next_id) {
+        std::cerr << "Error: pseudoalignment batch " << b.batch_id << " was written twice" << std::endl;
+        exit(1);
+      }
+      size_t i = b.batch_id - next_id;
+      if (i >= window.size()) {
+        window.resize(i + 1);
+        filled.resize(i + 1, false);
+      }
+      window[i] = std::move(b);
+      filled[i] = true;
+    }
+    batches.clear();
+    while (!filled.empty() && filled.front()) {
+      writePseudoAlignmentBatch(out, window.front());
+      window.pop_front();
+      filled.pop_front();
+      ++next_id;
+    }
+  }
+}
@@ -3,8 +3,14 @@
 
 
 #include <vector>
+#include <deque>
 #include <iostream>
+#include <fstream>
 #include <utility>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <htslib/sam.h>
 #include <htslib/hts.h>
 #include <htslib/bgzf.h>
@@ -41,6 +47,7 @@ struct PseudoAlignmentInfo {
 struct PseudoAlignmentBatch {
   int32_t batch_id;
   std::vector<PseudoAlignmentInfo> aln;
+  std::string reads; // name, sequence and quality of each read, kept when the input can't be read twice
   PseudoAlignmentBatch() : batch_id(-1) {}
 };
 
@@ -49,5 +56,31 @@ struct PseudoAlignmentBatch {
 void writePseudoAlignmentBatch(std::ofstream& of, const PseudoAlignmentBatch& batch);
 void readPseudoAlignmentBatch(std::ifstream& in, PseudoAlignmentBatch& batch);
 
+// Writes pseudoalignment batches to a file in batch id order from its own
+// thread, so mapping threads only queue their batch and move on. Batches that
+// arrive ahead of their turn wait in a reorder buffer indexed by batch id.
+class PseudoBatchWriter {
+public:
+  PseudoBatchWriter(std::ofstream& out);
+  ~PseudoBatchWriter();
+
+  void push(PseudoAlignmentBatch&& batch);
+  // writes out everything that was pushed and stops the writer thread
+  void finish();
+
+private:
+  void run();
+
+  std::ofstream& out;
+  std::mutex m;
+  std::condition_variable cv;
+  std::vector<PseudoAlignmentBatch> incoming;
+  std::deque<PseudoAlignmentBatch> window; // batch next_id first
+  std::deque<bool> filled;
+  int next_id;
+  bool done;
+  std::thread writer;
+};
+
 
 #endif // KALLISTO_PSEUDOBAM_H
\ No newline at end of file
@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ReadAhead.h"
+#include "PerfStats.h"
+
+// The threads doing blocking preads for every ReadAhead without io_uring.
+// They are shared so that the number of threads does not grow with the
+// number of open files, e.g. paired files of many cells in batch mode.
+// They are kept apart from ThreadPool on purpose: the readers run as pool
+// tasks and block until their read completes, so if the reads were queued
+// on the same pool, all workers could end up waiting on reads that no
+// worker is left to run.
+class ReadAheadWorkers {
+public:
+  static ReadAheadWorkers& get() {
+    // never destroyed, the threads wait for work until the process exits
+    static ReadAheadWorkers *w = new ReadAheadWorkers();
+    return *w;
+  }
+
+  void push(ReadAhead *ra, int i) {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      queue.emplace_back(ra, i);
+    }
+    cv.notify_one();
+  }
+
+  // drops the reads of ra that no thread has started on yet and marks them
+  // done, the others are done once they complete
+  void cancel(ReadAhead *ra) {
+    std::lock_guard<std::mutex> lock(m);
+    auto it = queue.begin();
+    while (it != queue.end()) {
+      if (it->first == ra) {
+        {
+          std::lock_guard<std::mutex> ra_lock(ra->m);
+          ra->slots[it->second].done = true;
+        }
+        it = queue.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+private:
+  static const int nthreads = 4;
+
+  ReadAheadWorkers() {
+    for (int i = 0; i < nthreads; i++) {
+      std::thread(&ReadAheadWorkers::work, this).detach();
+    }
+  }
+
+  void work() {
+    while (true) {
+      std::pair<ReadAhead*, int> job;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [this]() { return !queue.empty(); });
+        job = queue.front();
+        queue.pop_front();
+      }
+      job.first->complete(job.second);
+    }
+  }
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<std::pair<ReadAhead*, int>> queue;
+};
+
+ReadAhead::ReadAhead(int fd, size_t block_size, int depth) :
+  fd(fd), size(0), block_size(block_size), next_offset(0),
+  slots(depth), head(0), consumed(false) {
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    size = st.st_size;
+  }
+  // small files don't need full blocks, and the buffers are overwritten
+  // before they are read so they are left uninitialized
+  size_t n = std::min((uint64_t) block_size, size);
+  for (auto& s : slots) {
+    s.buf.reset(new char[n]);
+    s.done = true;
+  }
+#ifdef USE_IO_URING
+  uring = (io_uring_queue_init(depth, &ring, 0) == 0);
+#endif
+  for (int i = 0; i < depth; i++) {
+    submit(i);
+  }
+}
+
+ReadAhead::~ReadAhead() {
+#ifdef USE_IO_URING
+  if (uring) {
+    // the kernel may still write into the buffers
+    for (size_t i = 0; i < slots.size(); i++) {
+      wait(i);
+    }
+    io_uring_queue_exit(&ring);
+    return;
+  }
+#endif
+  // the shared threads may still be reading into the buffers
+  ReadAheadWorkers::get().cancel(this);
+  for (size_t i = 0; i < slots.size(); i++) {
+    wait(i);
+  }
+}
+
+ssize_t ReadAhead::next(const char*& data) {
+  if (consumed) {
+    // the block handed out last time is done with, reuse its buffer
+    submit(head);
+    head = (head + 1) % slots.size();
+  }
+  wait(head);
+  consumed = true;
+  data = slots[head].buf.get();
+  return slots[head].n;
+}
+
+void ReadAhead::submit(int i) {
+  Slot& s = slots[i];
+  s.offset = next_offset;
+  s.n = 0;
+  next_offset += block_size;
+  if (s.offset >= size) {
+    s.done = true;
+    return;
+  }
+  s.done = false;
+#ifdef USE_IO_URING
+  if (uring) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      finish(s);
+      s.done = true;
+      return;
+    }
+    size_t len = std::min((uint64_t) block_size, size - s.offset);
+    io_uring_prep_read(sqe, fd, s.buf.get(), len, s.offset);
+    io_uring_sqe_set_data(sqe, &s);
+    io_uring_submit(&ring);
+    return;
+  }
+#endif
+  ReadAheadWorkers::get().push(this, i);
+}
+
+void ReadAhead::wait(int i) {
+  Slot& s = slots[i];
+#ifdef USE_IO_URING
+  if (uring) {
+    while (!s.done) {
+      struct io_uring_cqe *cqe;
+      if (io_uring_wait_cqe(&ring, &cqe) < 0) {
+        continue;
+      }
+      Slot *t = (Slot*) io_uring_cqe_get_data(cqe);
+      t->n = (cqe->res < 0) ? -1 : cqe->res;
+      io_uring_cqe_seen(&ring, cqe);
+      finish(*t);
+      t->done = true;
+    }
+    return;
+  }
+#endif
+  std::unique_lock<std::mutex> lock(m);
+  done_cv.wait(lock, [&s]() { return s.done; });
+}
+
+// completes short reads with blocking preads
+void ReadAhead::finish(Slot& s) {
+  size_t len = std::min((uint64_t) block_size, size - s.offset);
+  while (s.n >= 0 && (size_t) s.n < len) {
+    ssize_t r = pread(fd, s.buf.get() + s.n, len - s.n, s.offset + s.n);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      if (r < 0) {
+        s.n = -1;
+      }
+      break;
+    }
+    s.n += r;
+  }
+}
+
+// runs on one of the shared threads
+void ReadAhead::complete(int i) {
+  finish(slots[i]);
+  // notify under the lock, once done is seen the destructor may return
+  std::lock_guard<std::mutex> lock(m);
+  slots[i].done = true;
+  done_cv.notify_all();
+}
+
+
+InputStream::InputStream() : gz(nullptr), fd(-1), ra(nullptr), started(false),
+  compressed(false), member_end(false), eof(false) {
+  memset(&zs, 0, sizeof(zs));
+}
+
+InputStream::~InputStream() {
+  if (gz) {
+    gzclose(gz);
+  }
+  delete ra;
+  if (compressed) {
+    inflateEnd(&zs);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+InputStream* InputStream::open(const std::string& fn) {
+  InputStream *in = new InputStream();
+  struct stat st;
+  if (fn == "-") {
+    in->gz = gzdopen(dup(fileno(stdin)), "r");
+  } else if (stat(fn.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+    in->fd = ::open(fn.c_str(), O_RDONLY);
+    if (in->fd >= 0) {
+      in->ra = new ReadAhead(in->fd);
+    }
+  } else {
+    in->gz = gzopen(fn.c_str(), "r");
+  }
+  if (in->gz == nullptr && in->ra == nullptr) {
+    delete in;
+    return nullptr;
+  }
+  return in;
+}
+
+bool InputStream::fill() {
+  const char *data;
+  ssize_t n = ra->next(data);
+  if (n < 0) {
+    std::cerr << "Error: could not read input file" << std::endl;
+    exit(1);
+  }
+  if (n == 0) {
+    eof = true;
+    return false;
+  }
+  zs.next_in = (Bytef*) data;
+  zs.avail_in = n;
+  return true;
+}
+
+int InputStream::read(void *buf, int len) {
+  PerfTimer timer;
+  int n = readSome(buf, len);
+  PerfCounters& perf = PerfStats::local();
+  perf.input_seconds += timer.seconds();
+  if (n > 0) {
+    perf.bytes_read += n;
+  }
+  return n;
+}
+
+int InputStream::readSome(void *buf, int len) {
+  if (gz) {
+    return gzread(gz, buf, len);
+  }
+  if (eof) {
+    return 0;
+  }
+  if (!started) {
+    started = true;
+    if (!fill()) {
+      return 0;
+    }
+    compressed = (zs.avail_in >= 2 && zs.next_in[0] == 0x1f && zs.next_in[1] == 0x8b);
+    if (compressed && inflateInit2(&zs, 15 + 16) != Z_OK) {
+      std::cerr << "Error: could not initialize zlib" << std::endl;
+      exit(1);
+    }
+  }
+
+  if (!compressed) {
+    char *out = (char*) buf;
+    int n = 0;
+    while (n < len) {
+      if (zs.avail_in == 0 && !fill()) {
+        break;
+      }
+      int k = std::min((uInt) (len - n), zs.avail_in);
+      memcpy(out + n, zs.next_in, k);
+      zs.next_in += k;
+      zs.avail_in -= k;
+      n += k;
+    }
+    return n;
+  }
+
+  zs.next_out = (Bytef*) buf;
+  zs.avail_out = len;
+  while (zs.avail_out > 0) {
+    if (zs.avail_in == 0 && !fill()) {
+      break;
+    }
+    if (member_end) {
+      // another gzip member may follow, anything else is ignored like gzread does
+      if (zs.next_in[0] != 0x1f) {
+        eof = true;
+        break;
+      }
+      inflateReset(&zs);
+      member_end = false;
+    }
+    int ret = inflate(&zs, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      member_end = true;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      std::cerr << "Error: could not decompress input file, it may be corrupted" << std::endl;
+      exit(1);
+    }
+  }
+  return len - zs.avail_out;
+}
@@ -0,0 +1,100 @@
+#ifndef KALLISTO_READAHEAD_H
+#define KALLISTO_READAHEAD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+#ifdef USE_IO_URING
+#include <liburing.h>
+#endif
+
+// Reads a file front to back while keeping several large reads in flight,
+// so that storage latency overlaps with decompression and mapping. Reads
+// are issued through io_uring when kallisto is built with USE_IO_URING and
+// the kernel supports it, otherwise blocking preads are issued by a few
+// threads shared by all open files.
+class ReadAhead {
+public:
+  ReadAhead(int fd, size_t block_size = 1 << 22, int depth = 4);
+  ~ReadAhead();
+
+  // hands out the next block of the file, data stays valid until the
+  // following call. returns the number of bytes, 0 at the end of the file
+  // and -1 on error
+  ssize_t next(const char*& data);
+
+private:
+  struct Slot {
+    std::unique_ptr<char[]> buf;
+    uint64_t offset;
+    ssize_t n;
+    bool done;
+  };
+
+  void submit(int i);
+  void wait(int i);
+  void finish(Slot& s);
+  void complete(int i);
+
+  int fd;
+  uint64_t size;
+  size_t block_size;
+  uint64_t next_offset;
+  std::vector<Slot> slots;
+  int head;
+  bool consumed;
+
+  // fallback when io_uring is not available
+  std::mutex m;
+  std::condition_variable done_cv;
+
+  friend class ReadAheadWorkers;
+
+#ifdef USE_IO_URING
+  struct io_uring ring;
+  bool uring;
+#endif
+};
+
+// Decompressing input for kseq. Regular files are read through ReadAhead
+// and inflated here, gzip files with several members are handled like gzread
+// does and uncompressed files are passed through. Standard input and named
+// pipes can't be read at an offset and go through gzread instead.
+class InputStream {
+public:
+  InputStream();
+  ~InputStream();
+
+  // returns nullptr if the file can't be opened
+  static InputStream* open(const std::string& fn);
+
+  // same contract as gzread
+  int read(void *buf, int len);
+
+private:
+  bool fill();
+  int readSome(void *buf, int len);
+
+  gzFile gz;
+  int fd;
+  ReadAhead *ra;
+  z_stream zs;
+  bool started;
+  bool compressed;
+  bool member_end;
+  bool eof;
+};
+
+static inline int readInputStream(InputStream *in, void *buf, int len) {
+  return in->read(buf, len);
+}
+
+#endif // KALLISTO_READAHEAD_H
@@ -0,0 +1,310 @@
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <zlib.h>
+
+#include "ReadCache.h"
+#include "kseq.h"
+
+#ifndef KSEQ_INIT_READY
+#define KSEQ_INIT_READY
+KSEQ_INIT(gzFile, gzread)
+#endif
+
+static const char READ_CACHE_MAGIC[4] = {'K', 'R', 'C', '1'};
+static const uint32_t BLOCK_MAX_BASES = 1 << 21;
+static const uint32_t BLOCK_MAX_READS = 1 << 16;
+
+// reads collected for the block being written
+struct ReadCacheBlockBuilder {
+  uint32_t nfrags = 0;
+  uint64_t bases = 0;
+  std::vector<uint32_t> lens;
+  std::vector<uint32_t> excpos;
+  std::string excchar;
+  std::string packed;
+  std::string names;
+  std::string quals;
+
+  void add(const kseq_t *seq, uint32_t flags) {
+    const char *s = seq->seq.s;
+    uint32_t len = seq->seq.l;
+    lens.push_back(len);
+    size_t start = packed.size();
+    packed.resize(start + (len + 3) / 4, 0);
+    for (uint32_t i = 0; i < len; i++) {
+      uint8_t code;
+      switch (s[i]) {
+        case 'A': code = 0; break;
+        case 'C': code = 1; break;
+        case 'G': code = 2; break;
+        case 'T': code = 3; break;
+        default:
+          code = 0;
+          excpos.push_back(bases + i);
+          excchar.push_back(s[i]);
+      }
+      packed[start + i/4] |= code << (2*(i%4));
+    }
+    bases += len;
+    if (flags & READ_CACHE_NAMES) {
+      names.append(seq->name.s, seq->name.l + 1);
+    }
+    if (flags & READ_CACHE_QUALS) {
+      quals.append(seq->qual.s, len);
+    }
+  }
+
+  bool full() const {
+    return bases >= BLOCK_MAX_BASES || lens.size() >= BLOCK_MAX_READS;
+  }
+
+  // appends the block to out, returns its size
+  uint64_t write(std::ofstream& out) const {
+    uint32_t hdr[4] = {nfrags, (uint32_t) excpos.size(), (uint32_t) names.size(), 0};
+    out.write((const char*) &hdr[0], sizeof(hdr));
+    out.write((const char*) lens.data(), lens.size() * sizeof(uint32_t));
+    out.write((const char*) excpos.data(), excpos.size() * sizeof(uint32_t));
+    out.write(excchar.data(), excchar.size());
+    out.write(packed.data(), packed.size());
+    out.write(names.data(), names.size());
+    out.write(quals.data(), quals.size());
+    return sizeof(hdr) + (lens.size() + excpos.size()) * sizeof(uint32_t)
+      + excchar.size() + packed.size() + names.size() + quals.size();
+  }
+
+  void clear() {
+    nfrags = 0;
+    bases = 0;
+    lens.clear();
+    excpos.clear();
+    excchar.clear();
+    packed.clear();
+    names.clear();
+    quals.clear();
+  }
+};
+
+bool isReadCache(const std::string& fn) {
+  std::ifstream in(fn, std::ios::binary);
+  char magic[4];
+  return in.read(&magic[0], 4) && memcmp(magic, READ_CACHE_MAGIC, 4) == 0;
+}
+
+bool readReadCacheInfo(const std::string& fn, ReadCacheInfo& info) {
+  std::ifstream in(fn, std::ios::binary);
+  char magic[4];
+  uint32_t unused;
+  uint64_t index_offset, nblocks;
+  if (!in.read(&magic[0], 4) || memcmp(magic, READ_CACHE_MAGIC, 4) != 0) {
+    return false;
+  }
+  in.read((char*) &info.nfiles, sizeof(info.nfiles));
+  in.read((char*) &info.flags, sizeof(info.flags));
+  in.read((char*) &unused, sizeof(unused));
+  in.read((char*) &index_offset, sizeof(index_offset));
+  in.seekg(index_offset);
+  in.read((char*) &nblocks, sizeof(nblocks));
+  info.blocks.resize(nblocks);
+  for (auto& b : info.blocks) {
+    in.read((char*) &b.offset, sizeof(b.offset));
+    in.read((char*) &b.size, sizeof(b.size));
+    in.read((char*) &b.first_read, sizeof(b.first_read));
+  }
+  return in.good();
+}
+
+void writeReadCache(const ProgramOptions& opt) {
+  uint32_t nfiles = opt.cache_nfiles;
+  uint32_t flags = (opt.cache_names ? READ_CACHE_NAMES : 0) | (opt.cache_quals ? READ_CACHE_QUALS : 0);
+  std::ofstream out(opt.output, std::ios::out | std::ios::binary);
+  if (!out.is_open()) {
+    std::cerr << "Error: could not open " << opt.output << " for writing" << std::endl;
+    exit(1);
+  }
+  uint32_t unused = 0;
+  uint64_t index_offset = 0;
+  out.write(READ_CACHE_MAGIC, 4);
+  out.write((char*) &nfiles, sizeof(nfiles));
+  out.write((char*) &flags, sizeof(flags));
+  out.write((char*) &unused, sizeof(unused));
+  out.write((char*) &index_offset, sizeof(index_offset));
+  uint64_t offset = 4 + 3*sizeof(uint32_t) + sizeof(uint64_t);
+
+  std::vector<ReadCacheBlock> blocks;
+  ReadCacheBlockBuilder block;
+  uint64_t numreads = 0;
+  auto flush = [&]() {
+    if (block.nfrags > 0) {
+      uint64_t size = block.write(out);
+      blocks.push_back({offset, size, numreads - block.nfrags});
+      offset += size;
+      block.clear();
+    }
+  };
+
+  std::vector<gzFile> fp(nfiles);
+  std::vector<kseq_t*> seq(nfiles);
+  std::vector<bool> ended(nfiles);
+  for (size_t f = 0; f + nfiles <= opt.files.size(); f += nfiles) {
+    for (uint32_t i = 0; i < nfiles; i++) {
+      fp[i] = gzopen(opt.files[f+i].c_str(), "r");
+      if (fp[i] == nullptr) {
+        std::cerr << "Error: could not open file " << opt.files[f+i] << std::endl;
+        exit(1);
+      }
+      seq[i] = kseq_init(fp[i]);
+    }
+    while (true) {
+      uint32_t done = 0;
+      for (uint32_t i = 0; i < nfiles; i++) {
+        int l = kseq_read(seq[i]);
+        ended[i] = (l < 0);
+        if (l < -1) {
+          std::cerr << "Error: malformed FASTQ record in " << opt.files[f+i]
+                    << ", the sequence and quality scores differ in length or the file is truncated" << std::endl;
+          exit(1);
+        }
+        done += (l < 0);
+      }
+      if (done == nfiles) {
+        break;
+      }
+      if (done > 0) {
+        // every file has to run out at the same read
+        uint32_t i = 0, j = 0;
+        while (!ended[i]) ++i;
+        while (ended[j]) ++j;
+        std::cerr << "Error: file " << opt.files[f+i] << " has fewer reads than "
+                  << opt.files[f+j] << std::endl;
+        exit(1);
+      }
+      for (uint32_t i = 0; i < nfiles; i++) {
+        if ((flags & READ_CACHE_QUALS) && seq[i]->qual.l != seq[i]->seq.l) {
+          std::cerr << "Error: --quals needs FASTQ input, " << opt.files[f+i]
+                    << " has reads without quality scores" << std::endl;
+          exit(1);
+        }
+        block.add(seq[i], flags);
+      }
+      block.nfrags++;
+      numreads++;
+      if (block.full()) {
+        flush();
+      }
+    }
+    for (uint32_t i = 0; i < nfiles; i++) {
+      kseq_destroy(seq[i]);
+      gzclose(fp[i]);
+    }
+  }
+  flush();
+
+  // block index at the end, its offset goes into the header
+  index_offset = offset;
+  uint64_t nblocks = blocks.size();
+  out.write((char*) &nblocks, sizeof(nblocks));
+  for (const auto& b : blocks) {
+    out.write((char*) &b.offset, sizeof(b.offset));
+    out.write((char*) &b.size, sizeof(b.size));
+    out.write((char*) &b.first_read, sizeof(b.first_read));
+  }
+  out.seekp(4 + 3*sizeof(uint32_t));
+  out.write((char*) &index_offset, sizeof(index_offset));
+  out.close();
+
+  std::cerr << "[cache] wrote " << pretty_num(numreads) << " reads in "
+            << pretty_num(nblocks) << " blocks to " << opt.output << std::endl;
+}
+
+// four bases per byte of packed sequence
+static const std::vector<uint32_t> readCacheTable = []() {
+  std::vector<uint32_t> t(256);
+  for (int i = 0; i < 256; i++) {
+    char c[4];
+    for (int j = 0; j < 4; j++) {
+      c[j] = "ACGT"[(i >> (2*j)) & 0x03];
+    }
+    memcpy(&t[i], c, 4);
+  }
+  return t;
+}();
+
+void decodeReadCacheBlock(const ReadCacheInfo& info, std::string& data, char *buf, size_t limit,
+                          std::vector<std::pair<const char*, int>>& seqs,
+                          std::vector<std::pair<const char*, int>>& names,
+                          std::vector<std::pair<const char*, int>>& quals,
+                          bool full) {
+  uint32_t hdr[4];
+  memcpy(&hdr[0], data.data(), sizeof(hdr));
+  size_t nreads = (size_t) hdr[0] * info.nfiles;
+  size_t nexc = hdr[1];
+  size_t pos = sizeof(hdr);
+  std::vector<uint32_t> lens(nreads), excpos(nexc);
+  memcpy(lens.data(), data.data() + pos, nreads * sizeof(uint32_t));
+  pos += nreads * sizeof(uint32_t);
+  memcpy(excpos.data(), data.data() + pos, nexc * sizeof(uint32_t));
+  pos += nexc * sizeof(uint32_t);
+  const char *excchar = data.data() + pos;
+  pos += nexc;
+  const uint8_t *packed = (const uint8_t*) data.data() + pos;
+
+  size_t needed = 0, npacked = 0, bases = 0;
+  for (auto len : lens) {
+    needed += len + 4 + (full ? len + 1 : 0);
+    npacked += (len + 3) / 4;
+    bases += len;
+  }
+  if (needed > limit) {
+    std::cerr << "Error: read cache block does not fit in the read buffer" << std::endl;
+    exit(1);
+  }
+
+  seqs.clear();
+  if (full) {
+    names.clear();
+    quals.clear();
+  }
+
+  char *p = buf;
+  size_t e = 0, start = 0;
+  for (size_t r = 0; r < nreads; r++) {
+    uint32_t len = lens[r];
+    size_t nbytes = (len + 3) / 4;
+    for (size_t j = 0; j < nbytes; j++) {
+      memcpy(p + 4*j, &readCacheTable[packed[j]], 4);
+    }
+    packed += nbytes;
+    for (; e < nexc && excpos[e] < start + len; e++) {
+      p[excpos[e] - start] = excchar[e];
+    }
+    p[len] = '\0';
+    seqs.emplace_back(p, len);
+    p += len + 1;
+    start += len;
+  }
+
+  if (full) {
+    char *n = &data[0] + pos + npacked;
+    const char *q = n + hdr[2];
+    for (size_t r = 0; r < nreads; r++) {
+      if (info.flags & READ_CACHE_NAMES) {
+        int nlen = strlen(n);
+        names.emplace_back(n, nlen);
+        n += nlen + 1;
+      } else {
+        names.emplace_back("", 0);
+      }
+      int len = lens[r];
+      if (info.flags & READ_CACHE_QUALS) {
+        memcpy(p, q, len);
+        q += len;
+      } else {
+        memset(p, 'I', len); // no qualities stored
+      }
+      p[len] = '\0';
+      quals.emplace_back(p, len);
+      p += len + 1;
+    }
+  }
+}
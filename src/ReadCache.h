@@ -0,0 +1,51 @@
+#ifndef KALLISTO_READCACHE_H
+#define KALLISTO_READCACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "common.h"
+
+// A read cache holds reads packed two bits per base in blocks that can be
+// decoded independently, so quant and bus can skip gzip and FASTQ parsing
+// when the same reads are processed more than once.
+//
+// header: magic "KRC1", uint32 nfiles, uint32 flags, uint32 unused,
+//         uint64 offset of the block index
+// block:  uint32 fragments, uint32 exceptions, uint32 name bytes, uint32 unused,
+//         uint32 read lengths, uint32 exception positions, exception bytes,
+//         packed bases (every read starts on a new byte), names, qualities
+// index:  uint64 number of blocks, then offset, size and first read of each
+//
+// Bases other than A, C, G and T are stored verbatim as exceptions.
+
+const uint32_t READ_CACHE_NAMES = 1;
+const uint32_t READ_CACHE_QUALS = 2;
+
+struct ReadCacheBlock {
+  uint64_t offset;
+  uint64_t size;
+  uint64_t first_read;
+};
+
+struct ReadCacheInfo {
+  uint32_t nfiles;
+  uint32_t flags;
+  std::vector<ReadCacheBlock> blocks;
+};
+
+bool isReadCache(const std::string& fn);
+bool readReadCacheInfo(const std::string& fn, ReadCacheInfo& info);
+void writeReadCache(const ProgramOptions& opt);
+
+// decodes a raw block into buf, which holds at most limit bytes. names
+// point into data, everything else into buf
+void decodeReadCacheBlock(const ReadCacheInfo& info, std::string& data, char *buf, size_t limit,
+                          std::vector<std::pair<const char*, int>>& seqs,
+                          std::vector<std::pair<const char*, int>>& names,
+                          std::vector<std::pair<const char*, int>>& quals,
+                          bool full);
+
+#endif // KALLISTO_READCACHE_H
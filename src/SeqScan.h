@@ -0,0 +1,172 @@
+#ifndef KALLISTO_SEQSCAN_H
+#define KALLISTO_SEQSCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Vectorized helpers for tokenizing FASTQ and FASTA text, the scalar
+// versions are used for the tails and on platforms without SSE2.
+
+// returns the first occurrence of c in [p, end), or end if there is none
+static inline const char* scanFor(const char *p, const char *end, char c) {
+#if defined(__AVX2__)
+  const __m256i needle = _mm256_set1_epi8(c);
+  while (end - p >= 32) {
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) p), needle));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 32;
+  }
+#elif defined(__SSE2__)
+  const __m128i needle = _mm_set1_epi8(c);
+  while (end - p >= 16) {
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), needle));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif
+  const char *r = (const char*) memchr(p, c, end - p);
+  return (r == NULL) ? end : r;
+}
+
+static inline char* scanFor(char *p, char *end, char c) {
+  return (char*) scanFor((const char*) p, (const char*) end, c);
+}
+
+// converts s to upper case in place, returns true if all of it is A, C, G or T
+static inline bool upperACGT(char *s, size_t len) {
+  size_t i = 0;
+  bool acgt = true;
+#if defined(__SSE2__)
+  const __m128i before_a = _mm_set1_epi8('a' - 1);
+  const __m128i after_z = _mm_set1_epi8('z' + 1);
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  const __m128i A = _mm_set1_epi8('A'), C = _mm_set1_epi8('C');
+  const __m128i G = _mm_set1_epi8('G'), T = _mm_set1_epi8('T');
+  __m128i good = _mm_cmpeq_epi8(A, A);
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*) (s + i));
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(x, before_a), _mm_cmplt_epi8(x, after_z));
+    x = _mm_sub_epi8(x, _mm_and_si128(lower, case_bit));
+    _mm_storeu_si128((__m128i*) (s + i), x);
+    __m128i ok = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, A), _mm_cmpeq_epi8(x, C)),
+                              _mm_or_si128(_mm_cmpeq_epi8(x, G), _mm_cmpeq_epi8(x, T)));
+    good = _mm_and_si128(good, ok);
+  }
+  acgt = (_mm_movemask_epi8(good) == 0xFFFF);
+#endif
+  for (; i < len; i++) {
+    char c = s[i];
+    if (c >= 'a' && c <= 'z') {
+      c -= 0x20;
+      s[i] = c;
+    }
+    acgt = acgt && (c == 'A' || c == 'C' || c == 'G' || c == 'T');
+  }
+  return acgt;
+}
+
+// returns the length of s once a trailing run of at least minrun A's is
+// removed, poly-A tails are clipped from the targets the same way
+static inline int trimPolyA(const char *s, int len, int minrun) {
+  int j = len;
+#if defined(__SSE2__)
+  const __m128i A = _mm_set1_epi8('A');
+  while (j >= 16 && _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (s + j - 16)), A)) == 0xFFFF) {
+    j -= 16;
+  }
+#endif
+  while (j > 0 && s[j-1] == 'A') {
+    j--;
+  }
+  return (len - j >= minrun) ? j : len;
+}
+
+// returns the position of the first occurrence of adapter in s, or of a
+// prefix of it at least minlen long that runs off the end of s. returns len
+// if there is none. candidates are found by comparing the first two bases
+static inline int findAdapter(const char *s, int len, const char *adapter, int alen, int minlen) {
+  minlen = (minlen < alen) ? minlen : alen;
+  if (minlen < 2) {
+    return len;
+  }
+  int last = len - minlen; // last possible start
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i c0 = _mm_set1_epi8(adapter[0]);
+  const __m128i c1 = _mm_set1_epi8(adapter[1]);
+  for (; i + 17 <= len && i <= last; i += 16) {
+    __m128i x0 = _mm_loadu_si128((const __m128i*) (s + i));
+    __m128i x1 = _mm_loadu_si128((const __m128i*) (s + i + 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x0, c0), _mm_cmpeq_epi8(x1, c1)));
+    while (mask != 0) {
+      int p = i + __builtin_ctz(mask);
+      if (p > last) {
+        return len;
+      }
+      int n = (alen < len - p) ? alen : len - p;
+      if (memcmp(s + p, adapter, n) == 0) {
+        return p;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i <= last; i++) {
+    int n = (alen < len - i) ? alen : len - i;
+    if (s[i] == adapter[0] && memcmp(s + i, adapter, n) == 0) {
+      return i;
+    }
+  }
+  return len;
+}
+
+// 2-bit codes of A, C, G and T in either case, 4 for anything else
+static inline const uint8_t* baseCodes() {
+  static const struct Table {
+    uint8_t c[256];
+    Table() {
+      memset(c, 4, sizeof(c));
+      c['A'] = c['a'] = 0;
+      c['C'] = c['c'] = 1;
+      c['G'] = c['g'] = 2;
+      c['T'] = c['t'] = 3;
+    }
+  } table;
+  return table.c;
+}
+
+// fills fw[j] and rc[j], for j < n, with the codes hexamerToInt gives the
+// 6 bases at s + j forward and reverse complemented, s must hold n + 5
+// bases. other bases count as A forward and T reverse complemented, the
+// way the bias model always rolled over them. bases are looked up a block
+// at a time so the code assembly below vectorizes
+static inline void hexamerCodes(const char *s, size_t n, uint16_t *fw, uint16_t *rc) {
+  const uint8_t *code = baseCodes();
+  const size_t block = 256;
+  uint8_t f[block + 5], r[block + 5];
+  for (size_t b = 0; b < n; b += block) {
+    size_t m = (n - b < block) ? n - b : block;
+    for (size_t i = 0; i < m + 5; i++) {
+      uint8_t c = code[(uint8_t) s[b + i]];
+      f[i] = (c > 3) ? 0 : c;
+      r[i] = (c > 3) ? 0 : 3 - c;
+    }
+    for (size_t j = 0; j < m; j++) {
+      fw[b + j] = (f[j] << 10) | (f[j+1] << 8) | (f[j+2] << 6) | (f[j+3] << 4) | (f[j+4] << 2) | f[j+5];
+      rc[b + j] = r[j] | (r[j+1] << 2) | (r[j+2] << 4) | (r[j+3] << 6) | (r[j+4] << 8) | (r[j+5] << 10);
+    }
+  }
+}
+
+#endif // KALLISTO_SEQSCAN_H
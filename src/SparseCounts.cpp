@@ -0,0 +1,70 @@
+#include <algorithm>
+
+#include "SparseCounts.h"
+
+void SparseCounts::add(const SparseCounts& o) {
+  if (o.empty()) {
+    return;
+  }
+  compact();
+  merge(o.counts);
+  for (auto id : o.pending) {
+    pending.push_back(id);
+  }
+  sum += o.sum;
+  compact();
+}
+
+void SparseCounts::release(Pairs& out) {
+  compact();
+  out.swap(counts);
+  clear();
+}
+
+void SparseCounts::clear() {
+  Pairs().swap(counts);
+  std::vector<int32_t>().swap(pending);
+  Pairs().swap(scratch);
+  sum = 0;
+}
+
+void SparseCounts::compact() {
+  if (pending.empty()) {
+    return;
+  }
+  std::sort(pending.begin(), pending.end());
+  Pairs b;
+  b.reserve(pending.size());
+  for (auto id : pending) {
+    if (!b.empty() && b.back().first == id) {
+      ++b.back().second;
+    } else {
+      b.push_back({id, 1});
+    }
+  }
+  pending.clear();
+  merge(b);
+}
+
+void SparseCounts::merge(const Pairs& b) {
+  if (b.empty()) {
+    return;
+  }
+  scratch.clear();
+  scratch.reserve(counts.size() + b.size());
+  size_t i = 0, j = 0;
+  while (i < counts.size() && j < b.size()) {
+    if (counts[i].first < b[j].first) {
+      scratch.push_back(counts[i++]);
+    } else if (b[j].first < counts[i].first) {
+      scratch.push_back(b[j++]);
+    } else {
+      scratch.push_back({counts[i].first, counts[i].second + b[j].second});
+      ++i;
+      ++j;
+    }
+  }
+  scratch.insert(scratch.end(), counts.begin() + i, counts.end());
+  scratch.insert(scratch.end(), b.begin() + j, b.end());
+  counts.swap(scratch);
+}
@@ -0,0 +1,52 @@
+#ifndef KALLISTO_SPARSECOUNTS_H
+#define KALLISTO_SPARSECOUNTS_H
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// Counts over the ECs of the index when only a few of them are seen, like
+// the reads of one cell in batch mode. Ids are appended as they come and
+// sorted into (id, count) pairs once enough have piled up, so time and
+// memory follow the number of ECs seen rather than the size of the index.
+class SparseCounts {
+public:
+  typedef std::vector<std::pair<int32_t, int32_t>> Pairs;
+
+  SparseCounts() : sum(0) {}
+
+  void add(int32_t id) {
+    pending.push_back(id);
+    ++sum;
+    if (pending.size() >= pendingLimit + counts.size()) {
+      compact();
+    }
+  }
+  void add(const SparseCounts& o);
+
+  // the ids seen and their counts, sorted by id
+  const Pairs& get() {
+    compact();
+    return counts;
+  }
+  // moves the counts out and clears
+  void release(Pairs& out);
+  void clear();
+
+  bool empty() const { return sum == 0; }
+  int64_t total() const { return sum; }
+
+private:
+  static const size_t pendingLimit = 4096;
+
+  void compact();
+  // merges the sorted pairs of b into counts
+  void merge(const Pairs& b);
+
+  Pairs counts;
+  std::vector<int32_t> pending;
+  Pairs scratch;
+  int64_t sum;
+};
+
+#endif // KALLISTO_SPARSECOUNTS_H
@@ -0,0 +1,130 @@
+#include "ThreadPool.h"
+
+// the pool the current thread works for and its queue in it
+static thread_local const ThreadPool* current_pool = nullptr;
+static thread_local int current_queue = -1;
+
+ThreadPool::ThreadPool(int nthreads) : queued(0), stop(false), next_queue(0) {
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  for (int i = 0; i < nthreads; i++) {
+    queues.emplace_back(new Queue());
+  }
+  for (int i = 0; i < nthreads; i++) {
+    workers.emplace_back(&ThreadPool::work, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    stop = true;
+  }
+  cv.notify_all();
+  for (auto& t : workers) {
+    t.join();
+  }
+}
+
+ThreadPool& ThreadPool::shared(int nthreads) {
+  static ThreadPool *pool = new ThreadPool(nthreads);
+  return *pool;
+}
+
+void ThreadPool::submit(Task t) {
+  int i = (current_pool == this) ? current_queue : (next_queue++ % queues.size());
+  {
+    std::lock_guard<std::mutex> lock(queues[i]->m);
+    queues[i]->tasks.push_back(std::move(t));
+  }
+  {
+    std::lock_guard<std::mutex> lock(m);
+    ++queued;
+  }
+  cv.notify_one();
+}
+
+// newest task of queue i, or the oldest of another queue
+bool ThreadPool::take(int i, Task& t) {
+  int n = queues.size();
+  if (i >= 0) {
+    Queue& q = *queues[i];
+    std::lock_guard<std::mutex> lock(q.m);
+    if (!q.tasks.empty()) {
+      t = std::move(q.tasks.back());
+      q.tasks.pop_back();
+      return true;
+    }
+  }
+  for (int j = 1; j <= n; j++) {
+    Queue& q = *queues[(i + j + n) % n];
+    std::lock_guard<std::mutex> lock(q.m);
+    if (!q.tasks.empty()) {
+      t = std::move(q.tasks.front());
+      q.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ThreadPool::runOne() {
+  Task t;
+  if (!take((current_pool == this) ? current_queue : -1, t)) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m);
+    --queued;
+  }
+  t();
+  return true;
+}
+
+void ThreadPool::work(int i) {
+  current_pool = this;
+  current_queue = i;
+  while (true) {
+    Task t;
+    if (take(i, t)) {
+      {
+        std::lock_guard<std::mutex> lock(m);
+        --queued;
+      }
+      t();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [this]() { return stop || queued > 0; });
+    if (stop && queued == 0) {
+      return;
+    }
+  }
+}
+
+
+TaskGroup::TaskGroup(ThreadPool& pool) : pool(pool), pending(0) {}
+
+TaskGroup::~TaskGroup() {
+  wait();
+}
+
+void TaskGroup::run(ThreadPool::Task t) {
+  ++pending;
+  pool.submit([this, t]() {
+    t();
+    std::lock_guard<std::mutex> lock(m);
+    if (--pending == 0) {
+      cv.notify_all();
+    }
+  });
+}
+
+void TaskGroup::wait() {
+  while (pending > 0 && pool.runOne()) {
+  }
+  // taking the lock also waits for the last task to be done with us
+  std::unique_lock<std::mutex> lock(m);
+  cv.wait(lock, [this]() { return pending == 0; });
+}
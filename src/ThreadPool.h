@@ -0,0 +1,72 @@
+#ifndef KALLISTO_THREADPOOL_H
+#define KALLISTO_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads shared by every phase of a run, so reads, batches, the
+// pseudobam pass and bootstraps reuse the same threads instead of each
+// starting their own.
+//
+// Every worker has its own queue. Tasks submitted from a worker go to the
+// back of its queue and it takes them from there, idle workers steal from
+// the front of the other queues. A thread waiting on a TaskGroup runs
+// queued tasks while it waits.
+class ThreadPool {
+public:
+  typedef std::function<void()> Task;
+
+  ThreadPool(int nthreads);
+  ~ThreadPool();
+
+  // the pool of the run, created with nthreads workers on the first call.
+  // it is never destroyed so exit() from a task can't wait on itself
+  static ThreadPool& shared(int nthreads);
+
+  int size() const { return workers.size(); }
+  void submit(Task t);
+  // runs one queued task on the calling thread, false if there was none
+  bool runOne();
+
+private:
+  struct Queue {
+    std::mutex m;
+    std::deque<Task> tasks;
+  };
+
+  void work(int i);
+  bool take(int i, Task& t);
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+  std::mutex m;
+  std::condition_variable cv;
+  int queued; // guarded by m
+  bool stop;
+  std::atomic<unsigned int> next_queue;
+};
+
+// tasks that are waited on together
+class TaskGroup {
+public:
+  TaskGroup(ThreadPool& pool);
+  ~TaskGroup();
+
+  void run(ThreadPool::Task t);
+  // returns once every task in the group has finished
+  void wait();
+
+private:
+  ThreadPool& pool;
+  std::atomic<int> pending;
+  std::mutex m;
+  std::condition_variable cv;
+};
+
+#endif // KALLISTO_THREADPOOL_H
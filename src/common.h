@@ -94,6 +94,14 @@ struct ProgramOptions {
   std::string chromFile;
   std::string bedFile;
   std::string technology;
+  double subsample; // fraction of reads to process
+  double saturation; // stop once EC proportions change less than this, 0 reads everything
+  bool trim_polya;
+  std::string adapter; // trimmed from the 3' end of reads
+  int dedup; // entries in the per thread cache of read sequences, 0 disables it
+  int cache_nfiles; // used for cache
+  bool cache_names;
+  bool cache_quals;
 
 ProgramOptions() :
   verbose(false),
@@ -124,7 +132,14 @@ ProgramOptions() :
   strand(StrandType::None),
   umi(false),
   inspect_thorough(false),
-  single_overhang(false)
+  single_overhang(false),
+  subsample(1.0),
+  saturation(0.0),
+  trim_polya(false),
+  dedup(0),
+  cache_nfiles(2),
+  cache_names(false),
+  cache_quals(false)
   {}
 };
 
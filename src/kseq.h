@@ -32,6 +32,8 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "SeqScan.h"
+
 #define KS_SEP_SPACE 0 // isspace(): \t, \n, \v, \f, \r
 #define KS_SEP_TAB   1 // isspace() && !' '
 #define KS_SEP_LINE  2 // line separator: "\n" (Unix) or "\r\n" (Windows)
@@ -108,8 +110,7 @@ typedef struct __kstring_t {
 				} else break;											\
 			}															\
 			if (delimiter == KS_SEP_LINE) { \
-				for (i = ks->begin; i < ks->end; ++i) \
-					if (ks->buf[i] == '\n') break; \
+				i = (int)((const unsigned char*)scanFor((const char*)ks->buf + ks->begin, (const char*)ks->buf + ks->end, '\n') - ks->buf); \
 			} else if (delimiter > KS_SEP_MAX) {						\
 				for (i = ks->begin; i < ks->end; ++i)					\
 					if (ks->buf[i] == delimiter) break;					\
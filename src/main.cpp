@@ -25,6 +25,7 @@
 #include "PlaintextWriter.h"
 #include "GeneModel.h"
 #include "Merge.h"
+#include "ReadCache.h"
 
 
 //#define ERROR_STR "\033[1mError:\033[0m"
@@ -160,6 +161,7 @@ void ParseOptionsEM(int argc, char **argv, ProgramOptions& opt) {
   int pbam_flag = 0;
   int gbam_flag = 0;
   int fusion_flag = 0;
+  int trim_polya_flag = 0;
 
   const char *opt_string = "t:i:l:s:o:n:m:d:b:g:c:";
   static struct option long_options[] = {
@@ -176,6 +178,11 @@ void ParseOptionsEM(int argc, char **argv, ProgramOptions& opt) {
     {"genomebam", no_argument, &gbam_flag, 1},
     {"fusion", no_argument, &fusion_flag, 1},
     {"seed", required_argument, 0, 'd'},
+    {"subsample", required_argument, 0, 'S'},
+    {"saturation", required_argument, 0, 'T'},
+    {"trim-polya", no_argument, &trim_polya_flag, 1},
+    {"adapter", required_argument, 0, 'A'},
+    {"dedup", required_argument, 0, 'D'},
     // short args
     {"threads", required_argument, 0, 't'},
     {"index", required_argument, 0, 'i'},
@@ -244,6 +251,23 @@ void ParseOptionsEM(int argc, char **argv, ProgramOptions& opt) {
       stringstream(optarg) >> opt.seed;
       break;
     }
+    case 'S': {
+      stringstream(optarg) >> opt.subsample;
+      break;
+    }
+    case 'T': {
+      stringstream(optarg) >> opt.saturation;
+      break;
+    }
+    case 'D': {
+      stringstream(optarg) >> opt.dedup;
+      break;
+    }
+    case 'A': {
+      opt.adapter = optarg;
+      std::transform(opt.adapter.begin(), opt.adapter.end(), opt.adapter.begin(), ::toupper);
+      break;
+    }
 
     default: break;
     }
@@ -300,6 +324,10 @@ void ParseOptionsEM(int argc, char **argv, ProgramOptions& opt) {
   if (fusion_flag) {
     opt.fusion = true;
   }
+
+  if (trim_polya_flag) {
+    opt.trim_polya = true;
+  }
 }
 
 void ParseOptionsEMOnly(int argc, char **argv, ProgramOptions& opt) {
@@ -523,6 +551,60 @@ void ParseOptionsMerge(int argc, char **argv, ProgramOptions& opt) {
  
 }
 
+void ParseOptionsCache(int argc, char **argv, ProgramOptions& opt) {
+  int single_flag = 0;
+  int names_flag = 0;
+  int quals_flag = 0;
+
+  const char *opt_string = "o:n:";
+  static struct option long_options[] = {
+    {"single", no_argument, &single_flag, 1},
+    {"names", no_argument, &names_flag, 1},
+    {"quals", no_argument, &quals_flag, 1},
+    {"output", required_argument, 0, 'o'},
+    {"num-files", required_argument, 0, 'n'},
+    {0,0,0,0}
+  };
+  int c;
+  int option_index = 0;
+  while (true) {
+    c = getopt_long(argc,argv,opt_string, long_options, &option_index);
+
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+    case 0:
+      break;
+    case 'o': {
+      opt.output = optarg;
+      break;
+    }
+    case 'n': {
+      stringstream(optarg) >> opt.cache_nfiles;
+      break;
+    }
+    default: break;
+    }
+  }
+
+  if (single_flag) {
+    opt.cache_nfiles = 1;
+  }
+  if (names_flag) {
+    opt.cache_names = true;
+  }
+  if (quals_flag) {
+    opt.cache_quals = true;
+  }
+
+  // all other arguments are fastq files to be read
+  for (int i = optind; i < argc; i++) {
+    opt.files.push_back(argv[i]);
+  }
+}
+
 void ListSingleCellTechnologies() {
   //todo, figure this out
   cout << "List of supported single-cell technologies" << endl << endl 
@@ -812,13 +894,22 @@ bool CheckOptionsBus(ProgramOptions& opt) {
     ret = false;
   } else {
     struct stat stFileInfo;
+    int nstdin = 0;
     for (auto& fn : opt.files) {
+      if (fn == "-") {
+        ++nstdin;
+        continue;
+      }
       auto intStat = stat(fn.c_str(), &stFileInfo);
       if (intStat != 0) {
         cerr << ERROR_STR << " file not found " << fn << endl;
         ret = false;
       }
     }
+    if (nstdin > 1) {
+      cerr << ERROR_STR << " standard input (-) can only be used for one read file" << endl;
+      ret = false;
+    }
   }
 
   if (opt.output.empty()) {
@@ -1058,7 +1149,14 @@ bool CheckOptionsBus(ProgramOptions& opt) {
 
   
 
-  if (ret && !opt.bam && opt.files.size() %  opt.busOptions.nfiles != 0) {
+  ReadCacheInfo cache;
+  if (ret && !opt.bam && opt.files.size() == 1 && readReadCacheInfo(opt.files[0], cache)) {
+    if (cache.nfiles != opt.busOptions.nfiles) {
+      cerr << "Error: read cache " << opt.files[0] << " holds " << cache.nfiles << " reads per fragment, technology "
+           << opt.technology << " requires " << opt.busOptions.nfiles << endl;
+      ret = false;
+    }
+  } else if (ret && !opt.bam && opt.files.size() %  opt.busOptions.nfiles != 0) {
     cerr << "Error: Number of files (" << opt.files.size() << ") does not match number of input files required by "
     << "technology " << opt.technology << " (" << opt.busOptions.nfiles << ")" << endl;
     ret = false;
@@ -1136,13 +1234,22 @@ bool CheckOptionsEM(ProgramOptions& opt, bool emonly = false) {
       ret = false;
     } else {
       struct stat stFileInfo;
+      int nstdin = 0;
       for (auto& fn : opt.files) {
+        if (fn == "-") {
+          ++nstdin;
+          continue;
+        }
         auto intStat = stat(fn.c_str(), &stFileInfo);
         if (intStat != 0) {
           cerr << ERROR_STR << " file not found " << fn << endl;
           ret = false;
         }
       }
+      if (nstdin > 1) {
+        cerr << ERROR_STR << " standard input (-) can only be used for one read file" << endl;
+        ret = false;
+      }
     }
 
     /*
@@ -1151,7 +1258,19 @@ bool CheckOptionsEM(ProgramOptions& opt, bool emonly = false) {
       ret = false;
     }*/
 
-    if (!opt.single_end) {
+    ReadCacheInfo cache;
+    if (opt.files.size() == 1 && readReadCacheInfo(opt.files[0], cache)) {
+      if (cache.nfiles != (opt.single_end ? 1 : 2)) {
+        cerr << "Error: read cache " << opt.files[0] << " holds " << cache.nfiles << " reads per fragment" << endl
+             << "       (use --single for single-end caches)" << endl;
+        ret = false;
+      }
+      if ((opt.pseudobam || opt.fusion) && !(cache.flags & READ_CACHE_NAMES)) {
+        cerr << "Error: --pseudobam and --fusion need read names, read cache " << opt.files[0] << " has none" << endl
+             << "       (build the cache with --names)" << endl;
+        ret = false;
+      }
+    } else if (!opt.single_end) {
       if (opt.files.size() % 2 != 0) {
         cerr << "Error: paired-end mode requires an even number of input files" << endl
             << "       (use --single for processing single-end reads)" << endl;
@@ -1201,6 +1320,34 @@ bool CheckOptionsEM(ProgramOptions& opt, bool emonly = false) {
     cerr << "Error: invalid value for minimum range " << opt.min_range << endl;
     ret = false;
   }
+
+  if (!(opt.subsample > 0.0 && opt.subsample <= 1.0)) {
+    cerr << "Error: subsample fraction must be in (0,1], got " << opt.subsample << endl;
+    ret = false;
+  } else if (opt.subsample < 1.0 && opt.pseudobam) {
+    cerr << "Error: --subsample cannot be used with --pseudobam or --genomebam" << endl;
+    ret = false;
+  }
+
+  if (opt.saturation < 0.0) {
+    cerr << "Error: invalid saturation tolerance " << opt.saturation << endl;
+    ret = false;
+  } else if (opt.saturation > 0.0 && opt.pseudobam) {
+    cerr << "Error: --saturation cannot be used with --pseudobam or --genomebam" << endl;
+    ret = false;
+  }
+
+  if (opt.dedup < 0) {
+    cerr << "Error: invalid size for the duplicate read cache " << opt.dedup << endl;
+    ret = false;
+  }
+
+  if (!opt.adapter.empty()) {
+    if (opt.adapter.size() < 2 || opt.adapter.find_first_not_of("ACGT") != std::string::npos) {
+      cerr << "Error: adapter sequence must be at least 2 bases of A, C, G and T, got " << opt.adapter << endl;
+      ret = false;
+    }
+  }
   
   if (opt.genomebam) {
     if (!opt.gtfFile.empty()) {
@@ -1302,6 +1449,42 @@ bool CheckOptionsEM(ProgramOptions& opt, bool emonly = false) {
 }
 
 
+bool CheckOptionsCache(ProgramOptions& opt) {
+  bool ret = true;
+
+  cerr << endl;
+  if (opt.output.empty()) {
+    cerr << ERROR_STR << " need to specify the read cache file to write" << endl;
+    ret = false;
+  }
+
+  if (opt.cache_nfiles <= 0) {
+    cerr << ERROR_STR << " invalid number of files per read " << opt.cache_nfiles << endl;
+    ret = false;
+  }
+
+  if (opt.files.size() == 0) {
+    cerr << ERROR_STR << " Missing read files" << endl;
+    ret = false;
+  } else {
+    struct stat stFileInfo;
+    for (auto& fn : opt.files) {
+      auto intStat = stat(fn.c_str(), &stFileInfo);
+      if (intStat != 0) {
+        cerr << ERROR_STR << " file not found " << fn << endl;
+        ret = false;
+      }
+    }
+    if (opt.cache_nfiles > 0 && opt.files.size() % opt.cache_nfiles != 0) {
+      cerr << ERROR_STR << " number of files (" << opt.files.size() << ") is not a multiple of "
+           << opt.cache_nfiles << endl;
+      ret = false;
+    }
+  }
+
+  return ret;
+}
+
 bool CheckOptionsMerge(ProgramOptions& opt) {
 
   bool ret = true;
@@ -1703,6 +1886,7 @@ void usage() {
        << "    bus           Generate BUS files for single-cell data " << endl
        << "    pseudo        Runs the pseudoalignment step " << endl
        << "    merge         Merges several batch runs " << endl
+       << "    cache         Converts FASTQ files into a 2-bit read cache" << endl
        << "    h5dump        Converts HDF5-formatted results to plaintext" << endl
        << "    inspect       Inspects and gives information about an index" << endl 
        << "    version       Prints version information" << endl
@@ -1713,7 +1897,8 @@ void usage() {
 void usageBus() {
   cout << "kallisto " << KALLISTO_VERSION << endl
        << "Generates BUS files for single-cell sequencing" << endl << endl
-       << "Usage: kallisto bus [arguments] FASTQ-files" << endl << endl
+       << "Usage: kallisto bus [arguments] FASTQ-files" << endl
+       << "       (use - as a file name to read from standard input)" << endl << endl
        << "Required arguments:" << endl
        << "-i, --index=STRING            Filename for the kallisto index to be used for" << endl
        << "                              pseudoalignment" << endl
@@ -1727,6 +1912,20 @@ void usageBus() {
        << "    --verbose                 Print out progress information every 1M proccessed reads" << endl;
 }
 
+void usageCache() {
+  cout << "kallisto " << KALLISTO_VERSION << endl
+       << "Converts FASTQ files into a read cache for quant and bus" << endl << endl
+       << "Usage: kallisto cache [arguments] FASTQ-files" << endl << endl
+       << "Required argument:" << endl
+       << "-o, --output=STRING           Filename for the read cache to be written" << endl << endl
+       << "Optional arguments:" << endl
+       << "-n, --num-files=INT           Number of files making up each fragment (default: 2)" << endl
+       << "    --single                  Single-end reads, same as -n 1" << endl
+       << "    --names                   Store read names (needed for --pseudobam)" << endl
+       << "    --quals                   Store quality strings" << endl << endl
+       << "Pass the read cache to quant or bus in place of the FASTQ files" << endl;
+}
+
 void usageIndex() {
   cout << "kallisto " << KALLISTO_VERSION << endl
        << "Builds a kallisto index" << endl << endl
@@ -1765,7 +1964,8 @@ void usageEM(bool valid_input = true) {
        << "Computes equivalence classes for reads and quantifies abundances" << endl << endl;
   }
   //      "----|----|----|----|----|----|----|----|----|----|----|----|----|----|----|----|"
-  cout << "Usage: kallisto quant [arguments] FASTQ-files" << endl << endl
+  cout << "Usage: kallisto quant [arguments] FASTQ-files" << endl
+       << "       (use - as a file name to read from standard input)" << endl << endl
        << "Required arguments:" << endl
        << "-i, --index=STRING            Filename for the kallisto index to be used for" << endl
        << "                              quantification" << endl
@@ -1786,6 +1986,17 @@ void usageEM(bool valid_input = true) {
        << "                              (default: -l, -s values are estimated from paired" << endl
        << "                               end data, but are required when using --single)" << endl
        << "-t, --threads=INT             Number of threads to use (default: 1)" << endl
+       << "    --subsample=DOUBLE        Fraction of fragments to process, chosen by read" << endl
+       << "                              number so runs are reproducible (default: 1)" << endl
+       << "    --saturation=DOUBLE       Stop reading once equivalence class proportions" << endl
+       << "                              change by less than this (L1 distance) over 1M" << endl
+       << "                              reads (default: 0, process all reads)" << endl
+       << "    --trim-polya              Trim poly-A tails (10 or more A's) off reads" << endl
+       << "    --adapter=STRING          Trim this adapter and everything after it off" << endl
+       << "                              the 3' end of reads" << endl
+       << "    --dedup=INT               Remember the pseudoalignments of up to this many" << endl
+       << "                              read sequences per thread so identical reads" << endl
+       << "                              are not matched again (default: 0, off)" << endl
        << "    --pseudobam               Save pseudoalignments to transcriptome to BAM file" << endl
        << "    --genomebam               Project pseudoalignments to genome sorted BAM file" << endl
        << "-g, --gtf                     GTF file for transcriptome information" << endl
@@ -2021,6 +2232,12 @@ int main(int argc, char *argv[]) {
         
         // write json file
         std::string call = argv_to_string(argc, argv);
+        if (opt.pseudobam) {
+          std::vector<double> fl_means(index.target_lens_.size(),0.0);
+          EMAlgorithm em(collection.counts, index, collection, fl_means, opt);
+          MP.processAln(em, false);
+        }
+
         plaintext_aux(
             opt.output + "/run_info.json",
             std::string(std::to_string(num_trans)),
@@ -2033,18 +2250,23 @@ int main(int argc, char *argv[]) {
             start_time,
             call);
 
-        if (opt.pseudobam) {
-          std::vector<double> fl_means(index.target_lens_.size(),0.0);
-          EMAlgorithm em(collection.counts, index, collection, fl_means, opt);
-          MP.processAln(em, false);
-        }
-
 
         cerr << endl;
         if (num_pseudoaligned == 0) {
           exit(1); // exit with error
         }
       }
+    } else if (cmd == "cache") {
+      if (argc == 2) {
+        usageCache();
+        return 0;
+      }
+      ParseOptionsCache(argc-1, argv+1, opt);
+      if (!CheckOptionsCache(opt)) {
+        usageCache();
+        exit(1);
+      }
+      writeReadCache(opt);
     } else if (cmd == "merge") {
       if (argc == 2) {
         usageMerge();
@@ -2179,18 +2401,6 @@ int main(int argc, char *argv[]) {
           std::cerr << "[~warn] Warning, zero reads pseudoaligned check your input files and index" << std::endl;
         }
 
-        plaintext_aux(
-            opt.output + "/run_info.json",
-            std::string(std::to_string(index.num_trans)),
-            std::string(std::to_string(opt.bootstrap)),
-            std::string(std::to_string(num_processed)),
-            std::string(std::to_string(num_pseudoaligned)),
-            std::string(std::to_string(num_unique)),
-            KALLISTO_VERSION,
-            std::string(std::to_string(index.INDEX_VERSION)),
-            start_time,
-            call);
-
         plaintext_writer(opt.output + "/abundance.tsv", em.target_names_,
             em.alpha_, em.eff_lens_, index.target_lens_);
 
@@ -2207,6 +2417,7 @@ int main(int argc, char *argv[]) {
             }
           }
         } else if (opt.bootstrap > 0 && num_pseudoaligned > 0) {
+          PerfStage stage("bootstrap");
           auto B = opt.bootstrap;
           std::mt19937_64 rand;
           rand.seed( opt.seed );
@@ -2254,7 +2465,20 @@ int main(int argc, char *argv[]) {
         
           MP.processAln(em, true);
         }
-        
+
+        // written last so the performance section covers every stage
+        plaintext_aux(
+            opt.output + "/run_info.json",
+            std::string(std::to_string(index.num_trans)),
+            std::string(std::to_string(opt.bootstrap)),
+            std::string(std::to_string(num_processed)),
+            std::string(std::to_string(num_pseudoaligned)),
+            std::string(std::to_string(num_unique)),
+            KALLISTO_VERSION,
+            std::string(std::to_string(index.INDEX_VERSION)),
+            start_time,
+            call,
+            opt.subsample);
 
         cerr << endl;
         if (num_pseudoaligned == 0) {
@@ -2445,18 +2669,6 @@ int main(int argc, char *argv[]) {
         }
         transout_f.close();
 
-        plaintext_aux(
-            opt.output + "/run_info.json",
-            std::string(std::to_string(index.num_trans)),
-            std::string(std::to_string(0)), // no bootstraps in pseudo
-            std::string(std::to_string(num_processed)),
-            std::string(std::to_string(num_pseudoaligned)),
-            std::string(std::to_string(num_unique)),
-            KALLISTO_VERSION,
-            std::string(std::to_string(index.INDEX_VERSION)),
-            start_time,
-            call);
-
         
         
         std::vector<std::vector<std::pair<int32_t, double>>> Abundance_mat;
@@ -2514,22 +2726,13 @@ int main(int argc, char *argv[]) {
             FLD_mat[id] = {mean_fl, sd_fl};
           }; // end of EM_lambda
 
-          std::vector<std::thread> workers;
+          // every cell is independent, the pool spreads them over the threads
+          TaskGroup workers(ThreadPool::shared(opt.threads));
           int num_ids = opt.batch_ids.size();
-          int id =0;
-          while (id < num_ids) {
-            workers.clear();
-            int nt = std::min(opt.threads, (num_ids - id));
-            int first_id = id;
-            for (int i = 0; i < nt; i++,id++) {
-              workers.emplace_back(std::thread(EM_lambda, id));
-              //workers.emplace_back(std::thread(ReadProcessor(index, opt, tc, *this, id,i)));
-            }
-            
-            for (int i = 0; i < nt; i++) {
-              workers[i].join();
-            }
+          for (int id = 0; id < num_ids; id++) {
+            workers.run([&EM_lambda, id]() { EM_lambda(id); });
           }
+          workers.wait();
 
           std::cerr << " done" << std::endl;
 
@@ -2614,6 +2817,18 @@ int main(int argc, char *argv[]) {
           EMAlgorithm em(collection.counts, index, collection, fl_means, opt);
           MP.processAln(em, false);
         }
+
+        plaintext_aux(
+            opt.output + "/run_info.json",
+            std::string(std::to_string(index.num_trans)),
+            std::string(std::to_string(0)), // no bootstraps in pseudo
+            std::string(std::to_string(num_processed)),
+            std::string(std::to_string(num_pseudoaligned)),
+            std::string(std::to_string(num_unique)),
+            KALLISTO_VERSION,
+            std::string(std::to_string(index.INDEX_VERSION)),
+            start_time,
+            call);
       }
 
       
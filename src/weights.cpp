@@ -1,4 +1,5 @@
 #include "weights.h"
+#include "SeqScan.h"
 
 #include <cmath>
 
@@ -78,25 +79,6 @@ std::vector<double> calc_eff_lens(const std::vector<int>& lengths,
   return eff_lens;
 }
 
-inline int update_hexamer(int hex, char c, bool revcomp) {
-  if (!revcomp) {
-    hex = ((hex & 0x3FF) << 2);
-    switch (c & 0xDF) {
-    case 'C': hex += 1; break;
-    case 'G': hex += 2; break;
-    case 'T': hex += 3; break;
-    }
-  } else {
-    hex = (hex >> 2);
-    switch (c & 0xDF) {
-    case 'A': hex += 3072; break;
-    case 'C': hex += 2048; break;
-    case 'G': hex += 1024; break;
-    }
-  }
-  return hex;
-}
-
 std::vector<double> update_eff_lens(
     const std::vector<double>& means,
     const MinCollector& tc,
@@ -118,7 +100,15 @@ std::vector<double> update_eff_lens(
   dbias5.resize(num6mers, 0.0); // clear the bias
 
   index.loadTranscriptSequences();
-  
+
+  // forward and reverse complement hexamer codes of one transcript at a time
+  size_t maxlen = 0;
+  for (int i = 0; i < index.num_trans; i++) {
+    maxlen = std::max(maxlen, index.target_seqs_[i].size());
+  }
+  std::vector<uint16_t> fwhex(maxlen), rchex(maxlen);
+  bool fwstrand = !opt.strand_specific || (opt.strand == ProgramOptions::StrandType::FR);
+  bool rcstrand = !opt.strand_specific || (opt.strand == ProgramOptions::StrandType::RF);
 
   for (int i = 0; i < index.num_trans; i++) {
     if (index.target_lens_[i] < means[i]) {
@@ -137,24 +127,21 @@ std::vector<double> update_eff_lens(
     }
     int seqlen = index.target_seqs_[i].size();
     const char* cs = index.target_seqs_[i].c_str();
+    if (seqlen > 6) {
+      hexamerCodes(cs, seqlen - 6, fwhex.data(), rchex.data());
+    }
 
-    if (!opt.strand_specific || (opt.strand == ProgramOptions::StrandType::FR)) {
-      int hex = hexamerToInt(cs,false);
+    if (fwstrand) {
       int fwlimit = (int) std::max(seqlen - means[i] - 6, 0.0);
       for (int j = 0; j < fwlimit; j++) {
-        dbias5[hex] += contrib;
-        hex = update_hexamer(hex,*(cs+j+6),false);
-      } 
+        dbias5[fwhex[j]] += contrib;
+      }
     }
 
-    if (!opt.strand_specific || (opt.strand == ProgramOptions::StrandType::RF)) {
+    if (rcstrand) {
       int bwlimit = (int) std::max(means[i] - 6, 0.0);
-      int hex = hexamerToInt(cs+bwlimit,true);
       for (int j = bwlimit; j < seqlen - 6; j++) {
-        dbias5[hex] += contrib;
-        if (j < seqlen - 6) {
-          hex = update_hexamer(hex,*(cs+j+6),true);
-        }
+        dbias5[rchex[j]] += contrib;
       }
     }
   }
@@ -163,6 +150,12 @@ std::vector<double> update_eff_lens(
     biasAlphaNorm += dbias5[i];
   }
 
+  // weight of each hexamer, divided once here instead of at every position
+  std::vector<double> hexweight(num6mers);
+  for (int i = 0; i < num6mers; i++) {
+    hexweight[i] = tc.bias5[i] / dbias5[i];
+  }
+
   std::vector<double> biaslens(index.num_trans);
 
   for (int i = 0; i < index.num_trans; i++) {
@@ -171,26 +164,21 @@ std::vector<double> update_eff_lens(
 
       int seqlen = index.target_seqs_[i].size();
       const char* cs = index.target_seqs_[i].c_str();
+      if (seqlen > 6) {
+        hexamerCodes(cs, seqlen - 6, fwhex.data(), rchex.data());
+      }
 
       // forward direction
-      if (!opt.strand_specific || (opt.strand == ProgramOptions::StrandType::FR)) {
-        int hex = hexamerToInt(cs,false);
+      if (fwstrand) {
         int fwlimit = (int) std::max(seqlen - means[i] - 6, 0.0);
         for (int j = 0; j < fwlimit; j++) {
-          //int hex = hexamerToInt(cs+j,false);
-          //efflen += 0.5*(tc.bias5[hex]/biasDataNorm) / (dbias5[hex]/biasAlphaNorm );
-          efflen += tc.bias5[hex] / dbias5[hex];
-          hex = update_hexamer(hex,*(cs+j+6),false);
+          efflen += hexweight[fwhex[j]];
         }
       }
-      if (!opt.strand_specific || (opt.strand == ProgramOptions::StrandType::RF)) {
+      if (rcstrand) {
         int bwlimit = (int) std::max(means[i] - 6 , 0.0);
-        int hex = hexamerToInt(cs+bwlimit,true);
         for (int j = bwlimit; j < seqlen - 6; j++) {
-          efflen += tc.bias5[hex] / dbias5[hex];
-          if (j < seqlen-6) {
-            hex = update_hexamer(hex,*(cs+j+6),true);
-          }
+          efflen += hexweight[rchex[j]];
         }
       }
       
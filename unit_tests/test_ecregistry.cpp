@@ -0,0 +1,40 @@
+#include "catch.hpp"
+
+#include <thread>
+#include <vector>
+
+#include "EcRegistry.h"
+
+TEST_CASE("new ECs get dense stable ids", "[ec_registry]")
+{
+    EcRegistry reg(100);
+    REQUIRE(reg.find({1, 2}) == -1);
+    REQUIRE(reg.findOrInsert({1, 2}) == 100);
+    REQUIRE(reg.findOrInsert({1, 3}) == 101);
+    REQUIRE(reg.findOrInsert({1, 2}) == 100);
+    REQUIRE(reg.find({1, 3}) == 101);
+
+    // many threads adding overlapping sets while the table grows
+    const int n = 20000;
+    std::vector<std::vector<int>> ids(4, std::vector<int>(n));
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 4; t++) {
+        workers.emplace_back([&reg, &ids, t]() {
+            for (int i = 0; i < n; i++) {
+                int j = (t % 2 == 0) ? i : n - 1 - i;
+                ids[t][j] = reg.findOrInsert({j, j + 1, j + 2});
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    REQUIRE(reg.size() == n + 2);
+    for (int i = 0; i < n; i++) {
+        REQUIRE(ids[0][i] == ids[1][i]);
+        REQUIRE(ids[0][i] == ids[2][i]);
+        REQUIRE(ids[0][i] == ids[3][i]);
+        REQUIRE(reg.get(ids[0][i] - reg.offset()) == std::vector<int>({i, i + 1, i + 2}));
+    }
+}
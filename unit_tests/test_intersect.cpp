@@ -0,0 +1,204 @@
+#include "catch.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "Intersect.h"
+#include "KmerIndex.h"
+#include "MinCollector.h"
+#include "kseq.h"
+
+// counts the allocations made on this thread while alloc_counting is set,
+// for the benchmarks below
+static thread_local bool alloc_counting = false;
+static thread_local size_t alloc_count = 0;
+
+void* operator new(std::size_t n) {
+    if (alloc_counting) {
+        ++alloc_count;
+    }
+    void *p = std::malloc(n ? n : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+TEST_CASE("in place intersection", "[intersect]")
+{
+    std::vector<int> x = {1, 3, 5, 7, 9, 11};
+    std::vector<int> y = {0, 3, 4, 5, 11, 12};
+    REQUIRE(intersect(x, y) == std::vector<int>({3, 5, 11}));
+
+    // the result is written over x without reallocating it
+    const int *data = x.data();
+    size_t cap = x.capacity();
+    intersectInPlace(x, y);
+    REQUIRE(x == std::vector<int>({3, 5, 11}));
+    REQUIRE(x.data() == data);
+    REQUIRE(x.capacity() == cap);
+
+    intersectInPlace(x, std::vector<int>({2, 4}));
+    REQUIRE(x.empty());
+    REQUIRE(x.data() == data);
+
+    std::vector<int> z;
+    intersectInPlace(z, y);
+    REQUIRE(z.empty());
+}
+
+TEST_CASE("intersection kernels", "[intersect]")
+{
+    typedef size_t (*Kernel)(const int*, size_t, const int*, size_t, int*);
+    std::vector<Kernel> kernels = {intersectScalar, intersectGalloping, intersectSSE2, intersectSorted};
+    if (hasAVX2()) {
+        kernels.push_back(intersectAVX2);
+    }
+
+    std::mt19937 rng(42);
+    for (int it = 0; it < 2000; it++) {
+        // similar sizes and 2 against a few hundred, like gene families
+        std::vector<int> a, b, expected;
+        int na = (it % 2 == 0) ? rng() % 40 : 2;
+        int nb = (it % 2 == 0) ? rng() % 40 : 500;
+        for (int i = 0, x = 0; i < na; i++) {
+            a.push_back(x += 1 + rng() % 3);
+        }
+        for (int i = 0, x = 0; i < nb; i++) {
+            b.push_back(x += 1 + rng() % 3);
+        }
+        std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+
+        for (auto kernel : kernels) {
+            std::vector<int> out(std::min(na, nb));
+            out.resize(kernel(a.data(), na, b.data(), nb, out.data()));
+            REQUIRE(out == expected);
+
+            // writing over either input
+            std::vector<int> x = a, y = b;
+            x.resize(kernel(x.data(), na, y.data(), nb, x.data()));
+            REQUIRE(x == expected);
+            x = a;
+            y.resize(kernel(x.data(), na, y.data(), nb, y.data()));
+            REQUIRE(y == expected);
+        }
+    }
+}
+
+
+#ifndef KSEQ_INIT_READY
+#define KSEQ_INIT_READY
+KSEQ_INIT(gzFile, gzread)
+#endif
+
+// the index and read pairs the benchmarks share, built on first use
+struct BenchData {
+    ProgramOptions opt;
+    std::unique_ptr<KmerIndex> index;
+    std::unique_ptr<MinCollector> tc;
+    std::vector<std::string> r1, r2;
+};
+
+static void readSeqs(const std::string& fn, std::vector<std::string>& seqs) {
+    gzFile fp = gzopen(fn.c_str(), "r");
+    REQUIRE(fp != nullptr);
+    kseq_t *seq = kseq_init(fp);
+    while (kseq_read(seq) >= 0) {
+        seqs.emplace_back(seq->seq.s, seq->seq.l);
+    }
+    kseq_destroy(seq);
+    gzclose(fp);
+}
+
+static BenchData& benchData() {
+    static BenchData d;
+    if (!d.index) {
+        d.opt.transfasta = {"../test/transcripts.fasta.gz"};
+        Bifrost::Kmer::set_k(d.opt.k);
+        d.index.reset(new KmerIndex(d.opt));
+        d.index->BuildTranscripts(d.opt);
+        d.tc.reset(new MinCollector(*d.index, d.opt));
+        readSeqs("../test/reads_1.fastq.gz", d.r1);
+        readSeqs("../test/reads_2.fastq.gz", d.r2);
+        REQUIRE(d.r1.size() == d.r2.size());
+    }
+    return d;
+}
+
+// per-read scratch space, kept between reads like ReadProcessor does
+struct PairScratch {
+    std::vector<EcDataPair> v1, v2;
+    std::vector<int> u, utmp;
+};
+
+// pseudoaligns every pair the way the read loop does, returns the number
+// of pairs that map
+static size_t mapPairs(BenchData& d, PairScratch& s, bool collapse) {
+    size_t mapped = 0;
+    for (size_t i = 0; i < d.r1.size(); i++) {
+        s.v1.clear();
+        s.v2.clear();
+        s.u.clear();
+        s.utmp.clear();
+        d.index->match(d.r1[i].c_str(), d.r1[i].size(), s.v1, collapse);
+        d.tc->intersectECs(s.v1, s.u);
+        d.index->match(d.r2[i].c_str(), d.r2[i].size(), s.v2, collapse);
+        d.tc->intersectECs(s.v2, s.utmp);
+        d.tc->intersectMates(s.v1, s.v2, s.u, s.utmp);
+        if (!s.u.empty()) {
+            ++mapped;
+        }
+    }
+    return mapped;
+}
+
+TEST_CASE("allocations per read", "[.][bench]")
+{
+    BenchData& d = benchData();
+    PairScratch s;
+    // the first pass grows the scratch vectors to the largest read
+    size_t mapped = mapPairs(d, s, true);
+
+    alloc_count = 0;
+    alloc_counting = true;
+    REQUIRE(mapPairs(d, s, true) == mapped);
+    alloc_counting = false;
+
+    std::cout << d.r1.size() << " pairs, " << mapped << " mapped, "
+              << (double) alloc_count / d.r1.size() << " allocations per pair" << std::endl;
+    REQUIRE(alloc_count == 0);
+}
+
+TEST_CASE("collapsed versus uncollapsed matches", "[.][bench]")
+{
+    BenchData& d = benchData();
+    PairScratch s;
+    const int rounds = 5;
+    size_t mapped = mapPairs(d, s, false);
+    REQUIRE(mapPairs(d, s, true) == mapped);
+
+    double secs[2] = {0.0, 0.0};
+    for (int r = 0; r < rounds; r++) {
+        for (int collapse = 0; collapse < 2; collapse++) {
+            auto t0 = std::chrono::steady_clock::now();
+            REQUIRE(mapPairs(d, s, collapse) == mapped);
+            secs[collapse] += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        }
+    }
+    double pairs = (double) rounds * d.r1.size();
+    std::cout << "uncollapsed: " << 1e9 * secs[0] / pairs << " ns per pair" << std::endl;
+    std::cout << "collapsed:   " << 1e9 * secs[1] / pairs << " ns per pair" << std::endl;
+}
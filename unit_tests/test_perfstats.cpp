@@ -0,0 +1,45 @@
+#include "catch.hpp"
+
+#include <thread>
+#include <vector>
+
+#include "PerfStats.h"
+
+TEST_CASE("per-thread counters are summed", "[perf_stats]")
+{
+    PerfCounters before = PerfStats::total();
+
+    // threads that have exited still count
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 4; t++) {
+        workers.emplace_back([]() {
+            for (int i = 0; i < 1000; i++) {
+                PerfStats::local().kmer_lookups += 2;
+                PerfStats::local().kmer_hits += 1;
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    PerfStats::local().bytes_read += 100;
+
+    PerfCounters after = PerfStats::total();
+    REQUIRE(after.kmer_lookups - before.kmer_lookups == 8000);
+    REQUIRE(after.kmer_hits - before.kmer_hits == 4000);
+    REQUIRE(after.bytes_read - before.bytes_read == 100);
+
+    PerfStats::addStage("test_a", 1.0);
+    PerfStats::addStage("test_b", 0.5);
+    PerfStats::addStage("test_a", 2.0);
+    double a = -1.0, b = -1.0;
+    for (const auto& s : PerfStats::stages()) {
+        if (s.first == "test_a") {
+            a = s.second;
+        } else if (s.first == "test_b") {
+            b = s.second;
+        }
+    }
+    REQUIRE(a == 3.0);
+    REQUIRE(b == 0.5);
+}
@@ -0,0 +1,47 @@
+#include "catch.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include "PseudoBam.h"
+
+TEST_CASE("pseudoalignment batches are written in id order", "[pseudobam]")
+{
+    const int n = 100;
+    {
+        std::ofstream out("pseudobatch_test.bin", std::ios::out | std::ios::binary);
+        PseudoBatchWriter writer(out);
+        // every thread pushes its ids backwards, so most batches arrive early
+        std::vector<std::thread> workers;
+        for (int t = 0; t < 4; t++) {
+            workers.emplace_back([&writer, t, n]() {
+                for (int id = n - 1 - t; id >= 0; id -= 4) {
+                    PseudoAlignmentBatch b;
+                    b.batch_id = id;
+                    PseudoAlignmentInfo info;
+                    info.id = id;
+                    b.aln.push_back(info);
+                    writer.push(std::move(b));
+                }
+            });
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        writer.finish();
+    }
+
+    std::ifstream in("pseudobatch_test.bin", std::ios::in | std::ios::binary);
+    for (int id = 0; id < n; id++) {
+        PseudoAlignmentBatch b;
+        readPseudoAlignmentBatch(in, b);
+        REQUIRE(b.batch_id == id);
+        REQUIRE(b.aln.size() == 1);
+        REQUIRE(b.aln[0].id == id);
+    }
+    REQUIRE(in.peek() == EOF);
+    in.close();
+    remove("pseudobatch_test.bin");
+}
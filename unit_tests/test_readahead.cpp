@@ -0,0 +1,49 @@
+#include "catch.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <zlib.h>
+
+#include "ReadAhead.h"
+
+static std::string readAll(const std::string& fn) {
+    InputStream *in = InputStream::open(fn);
+    REQUIRE(in != nullptr);
+    std::string out;
+    char buf[1000];
+    int n;
+    while ((n = in->read(buf, sizeof(buf))) > 0) {
+        out.append(buf, n);
+    }
+    delete in;
+    return out;
+}
+
+TEST_CASE("read ahead input stream", "[read_ahead]")
+{
+    std::string text;
+    for (int i = 0; i < 200000; i++) {
+        text += "@read" + std::to_string(i) + "\nACGTACGTACGT\n+\nFFFFFFFFFFFF\n";
+    }
+
+    std::ofstream plain("readahead_test.fastq", std::ios::binary);
+    plain << text;
+    plain.close();
+    REQUIRE(readAll("readahead_test.fastq") == text);
+
+    // two gzip members, like files that were concatenated with cat
+    size_t half = text.size() / 2;
+    gzFile gz = gzopen("readahead_test.fastq.gz", "wb");
+    gzwrite(gz, text.c_str(), half);
+    gzclose(gz);
+    gz = gzopen("readahead_test.fastq.gz", "ab");
+    gzwrite(gz, text.c_str() + half, text.size() - half);
+    gzclose(gz);
+    REQUIRE(readAll("readahead_test.fastq.gz") == text);
+
+    REQUIRE(InputStream::open("readahead_test.missing") == nullptr);
+
+    remove("readahead_test.fastq");
+    remove("readahead_test.fastq.gz");
+}
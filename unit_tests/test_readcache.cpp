@@ -0,0 +1,53 @@
+#include "catch.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "ReadCache.h"
+
+TEST_CASE("read cache round trip", "[read_cache]")
+{
+    std::vector<std::string> reads {"ACGTACGTTTGA", "acgtNNACGT", "A", "GATTACAGATTACAGATTACA", "CCCCN"};
+    std::ofstream fq("readcache_test.fastq");
+    for (size_t i = 0; i < reads.size(); i++) {
+        fq << "@read" << i << " comment\n" << reads[i] << "\n+\n" << std::string(reads[i].size(), 'F') << "\n";
+    }
+    fq.close();
+
+    ProgramOptions opt;
+    opt.files = {"readcache_test.fastq"};
+    opt.output = "readcache_test.krc";
+    opt.cache_nfiles = 1;
+    opt.cache_names = true;
+    writeReadCache(opt);
+
+    REQUIRE(isReadCache(opt.output));
+    REQUIRE(!isReadCache(opt.files[0]));
+
+    ReadCacheInfo info;
+    REQUIRE(readReadCacheInfo(opt.output, info));
+    REQUIRE(info.nfiles == 1);
+    REQUIRE(info.blocks.size() == 1);
+
+    std::ifstream in(opt.output, std::ios::binary);
+    std::string data(info.blocks[0].size, '\0');
+    in.seekg(info.blocks[0].offset);
+    in.read(&data[0], data.size());
+
+    std::vector<char> buf(1 << 16);
+    std::vector<std::pair<const char*, int>> seqs, names, quals;
+    decodeReadCacheBlock(info, data, buf.data(), buf.size(), seqs, names, quals, true);
+    REQUIRE(seqs.size() == reads.size());
+    for (size_t i = 0; i < reads.size(); i++) {
+        REQUIRE(std::string(seqs[i].first) == reads[i]);
+        REQUIRE(seqs[i].second == reads[i].size());
+        REQUIRE(std::string(names[i].first) == "read" + std::to_string(i));
+        REQUIRE(quals[i].second == reads[i].size());
+    }
+
+    remove(opt.files[0].c_str());
+    remove(opt.output.c_str());
+}
@@ -0,0 +1,176 @@
+#include "catch.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "SeqScan.h"
+#include "kseq.h"
+
+TEST_CASE("scan for newlines", "[seqscan]")
+{
+    std::string s(100, 'A');
+    const char *b = s.c_str();
+    const char *e = b + s.size();
+    REQUIRE(scanFor(b, e, '\n') == e);
+
+    for (size_t i = 0; i < s.size(); i++) {
+        std::string t = s;
+        t[i] = '\n';
+        t[s.size() - 1] = '\n';
+        REQUIRE(scanFor(t.c_str(), t.c_str() + t.size(), '\n') == t.c_str() + i);
+    }
+}
+
+TEST_CASE("uppercase and check bases", "[seqscan]")
+{
+    std::string s = "acgtACGTacgtACGTacgtACGTacgtACGTacg";
+    REQUIRE(upperACGT(&s[0], s.size()));
+    REQUIRE(s == "ACGTACGTACGTACGTACGTACGTACGTACGTACG");
+
+    for (size_t i = 0; i < s.size(); i++) {
+        std::string t = s;
+        t[i] = (i % 2) ? 'n' : 'U';
+        REQUIRE(!upperACGT(&t[0], t.size()));
+        REQUIRE(t[i] == ((i % 2) ? 'N' : 'U'));
+    }
+}
+
+
+// read a gzipped file into memory for the benchmark below
+struct MemStream {
+    std::string data;
+    size_t pos;
+};
+
+static int memRead(MemStream *m, void *buf, int len) {
+    int n = std::min((size_t) len, m->data.size() - m->pos);
+    memcpy(buf, m->data.c_str() + m->pos, n);
+    m->pos += n;
+    return n;
+}
+
+KSEQ_INIT(MemStream*, memRead)
+
+// how ks_getuntil found line ends before it used scanFor
+static const char* byteLoopFind(const char *b, const char *e, char c) {
+    for (; b < e; ++b) {
+        if (*b == c) break;
+    }
+    return b;
+}
+
+TEST_CASE("scanner versus byte loop", "[.][bench]")
+{
+    MemStream m;
+    m.pos = 0;
+    gzFile fp = gzopen("../test/reads_1.fastq.gz", "r");
+    REQUIRE(fp != nullptr);
+    char buf[1<<16];
+    int n;
+    while ((n = gzread(fp, buf, sizeof(buf))) > 0) {
+        m.data.append(buf, n);
+    }
+    gzclose(fp);
+
+    const int rounds = 20;
+    size_t kseq_bases = 0, loop_bases = 0, scan_bases = 0;
+
+    // the same record walk with the old byte loop and with the scanner
+    auto tl = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        const char *p = m.data.c_str();
+        const char *e = p + m.data.size();
+        while (p < e) {
+            const char *s = byteLoopFind(p, e, '\n') + 1;
+            const char *plus = byteLoopFind(s, e, '\n');
+            loop_bases += plus - s;
+            p = byteLoopFind(byteLoopFind(plus + 1, e, '\n') + 1, e, '\n') + 1;
+        }
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        m.pos = 0;
+        kseq_t *seq = kseq_init(&m);
+        while (kseq_read(seq) >= 0) {
+            kseq_bases += seq->seq.l;
+        }
+        kseq_destroy(seq);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        const char *p = m.data.c_str();
+        const char *e = p + m.data.size();
+        while (p < e) {
+            const char *s = scanFor(p, e, '\n') + 1;
+            const char *plus = scanFor(s, e, '\n');
+            scan_bases += plus - s;
+            p = scanFor(scanFor(plus + 1, e, '\n') + 1, e, '\n') + 1;
+        }
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    REQUIRE(kseq_bases == scan_bases);
+    REQUIRE(loop_bases == scan_bases);
+    std::cout << "byte loop: " << std::chrono::duration<double>(t0 - tl).count() << "s" << std::endl;
+    std::cout << "scanner:   " << std::chrono::duration<double>(t2 - t1).count() << "s" << std::endl;
+    std::cout << "kseq:      " << std::chrono::duration<double>(t1 - t0).count() << "s" << std::endl;
+}
+
+TEST_CASE("trim poly-A tails and adapters", "[seqscan]")
+{
+    std::string s = "ACGTTGCA" + std::string(40, 'A');
+    REQUIRE(trimPolyA(s.c_str(), s.size(), 10) == 7);
+    REQUIRE(trimPolyA(s.c_str(), 12, 10) == 12);
+    std::string a = std::string(30, 'A');
+    REQUIRE(trimPolyA(a.c_str(), a.size(), 10) == 0);
+
+    std::string adapter = "AGATCGGAAGAGC";
+    std::string insert = "CCGTAGCTAGCTAGGATCGATCGTAGCTAGCATCG";
+    std::string r = insert + adapter + "TTTT";
+    REQUIRE(findAdapter(r.c_str(), r.size(), adapter.c_str(), adapter.size(), 8) == insert.size());
+    for (int n = 1; n <= adapter.size(); n++) {
+        std::string t = insert + adapter.substr(0, n);
+        int expected = (n >= 8) ? insert.size() : t.size();
+        REQUIRE(findAdapter(t.c_str(), t.size(), adapter.c_str(), adapter.size(), 8) == expected);
+    }
+    REQUIRE(findAdapter(insert.c_str(), insert.size(), adapter.c_str(), adapter.size(), 8) == insert.size());
+}
+
+TEST_CASE("hexamer codes", "[seqscan]")
+{
+    std::string s;
+    const char bases[] = "ACGTACGTNacgt";
+    for (int i = 0; i < 1000; i++) {
+        s += bases[(i * 7 + i / 13) % 13];
+    }
+    size_t n = s.size() - 5;
+    std::vector<uint16_t> fw(n), rc(n);
+    hexamerCodes(s.c_str(), n, fw.data(), rc.data());
+
+    // rolled one base at a time like the bias model used to
+    int f = 0, r = 0;
+    for (size_t i = 0; i < s.size(); i++) {
+        int c = 0;
+        switch (s[i] & 0xDF) {
+        case 'C': c = 1; break;
+        case 'G': c = 2; break;
+        case 'T': c = 3; break;
+        }
+        bool acgt = strchr("ACGT", s[i] & 0xDF) != nullptr;
+        f = ((f & 0x3FF) << 2) | c;
+        r = (r >> 2) | ((acgt ? 3 - c : 0) << 10);
+        if (i >= 5) {
+            REQUIRE(fw[i - 5] == f);
+            REQUIRE(rc[i - 5] == r);
+        }
+    }
+
+    uint16_t x, y;
+    hexamerCodes("ACGTAC", 1, &x, &y);
+    REQUIRE(x == 0x1B1); // 00 01 10 11 00 01
+    REQUIRE(y == 0xB1B); // GTACGT, the reverse complement
+}
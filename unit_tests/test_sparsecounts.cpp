@@ -0,0 +1,42 @@
+#include "catch.hpp"
+
+#include <random>
+#include <vector>
+
+#include "SparseCounts.h"
+
+TEST_CASE("sparse counts match dense counts", "[sparse_counts]")
+{
+    const int n = 1000000;
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> few(0, 50), many(0, n - 1);
+
+    std::vector<int> dense(n, 0);
+    SparseCounts a, b;
+    // enough ids to be compacted several times, with few distinct ones
+    for (int i = 0; i < 30000; i++) {
+        int id = (i % 3 == 0) ? many(rng) : few(rng);
+        ++dense[id];
+        if (i % 2 == 0) {
+            a.add(id);
+        } else {
+            b.add(id);
+        }
+    }
+    a.add(b);
+    REQUIRE(a.total() == 30000);
+
+    SparseCounts::Pairs expected;
+    for (int i = 0; i < n; i++) {
+        if (dense[i] > 0) {
+            expected.push_back({i, dense[i]});
+        }
+    }
+    REQUIRE(a.get() == expected);
+
+    SparseCounts::Pairs out;
+    a.release(out);
+    REQUIRE(out == expected);
+    REQUIRE(a.empty());
+    REQUIRE(a.get().empty());
+}
@@ -0,0 +1,35 @@
+#include "catch.hpp"
+
+#include <atomic>
+#include <vector>
+
+#include "ThreadPool.h"
+
+TEST_CASE("thread pool runs every task", "[thread_pool]")
+{
+    ThreadPool pool(4);
+    std::atomic<long> sum(0);
+    {
+        TaskGroup g(pool);
+        for (int i = 1; i <= 1000; i++) {
+            g.run([&sum, i]() { sum += i; });
+        }
+        g.wait();
+        REQUIRE(sum == 500500);
+    }
+
+    // tasks that wait on their own subtasks, more of them than threads
+    sum = 0;
+    TaskGroup outer(pool);
+    for (int i = 0; i < 16; i++) {
+        outer.run([&pool, &sum]() {
+            TaskGroup inner(pool);
+            for (int j = 0; j < 100; j++) {
+                inner.run([&sum]() { sum += 1; });
+            }
+            inner.wait();
+        });
+    }
+    outer.wait();
+    REQUIRE(sum == 1600);
+}
@@ -0,0 +1,34 @@
+#include "catch.hpp"
+
+#include <cstring>
+#include <string>
+
+#include "BUSData.h"
+
+static uint64_t pack(UMIPacker& p, const std::string& s) {
+    return p.pack(s.c_str(), s.size());
+}
+
+TEST_CASE("UMI keys are equal exactly when the UMIs are", "[umi]")
+{
+    UMIPacker p;
+    REQUIRE(pack(p, "ACGT") == pack(p, "ACGT"));
+    REQUIRE(pack(p, "ACGT") != pack(p, "ACGG"));
+    // the same bases with a different length
+    REQUIRE(pack(p, "AAAA") != pack(p, "AAAAA"));
+
+    // stringToBinary reads N as G and only keeps where the first N is
+    REQUIRE(pack(p, "ANGN") != pack(p, "ANNG"));
+    REQUIRE(pack(p, "ANGN") != pack(p, "AGGG"));
+    REQUIRE(pack(p, "ANGN") == pack(p, "ANGN"));
+
+    // long UMIs with an N, and ones that only differ past 32 bases
+    std::string a(30, 'A'), b(30, 'A');
+    a[1] = 'N';
+    b[1] = 'G';
+    REQUIRE(pack(p, a) != pack(p, b));
+    REQUIRE(pack(p, a) == pack(p, a));
+    std::string c(40, 'C'), d(40, 'C');
+    d[35] = 'T';
+    REQUIRE(pack(p, c) != pack(p, d));
+}